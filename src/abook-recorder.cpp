@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <signal.h>
 #include <stdint.h>
 #include <fcntl.h>
@@ -22,20 +23,50 @@
 #include <alsa/asoundlib.h>
 #include <pwd.h>
 #include <dirent.h>
-#include <sys/wait.h>
 #include <pocketsphinx.h>
-
-// Maximum 60 seconds of recording per segment
-#define MAX_SAMPLES (sample_rate * 60)
-
-extern snd_pcm_t *open_audiofd( char *device_name, int capture, int rate, int channels, int period, int nperiods );
-
-int16_t *recordingBuffer; //[MAX_SAMPLES * 2];
+#include "capture.h"
+#include "wavfile.h"
+#include "segwriter.h"
+#include "combine.h"
+#include "manifest.h"
+#include "loudness.h"
+#include "trim.h"
+#include "kernels.h"
+#include "peaks.h"
+#include "textcache.h"
+#include "recognizer.h"
+#include "session.h"
+#include "stats.h"
+#include "events.h"
+
+// How much audio the capture thread can hold while the UI is busy
+#define CAPTURE_RING_SAMPLES (sample_rate * 4)
+
+// Audio from before R is pressed that a take starts with, in ms
+#define DEFAULT_PREROLL_MS 300
+#define MAX_PREROLL_MS     2000
+
+// The main loop sleeps until something happens.  It still comes round
+// now and then so that a signal is noticed, and more often while the
+// segment writer is holding us up.
+#define IDLE_WAKE_MS    1000
+#define BACKLOG_POLL_MS 5
+
+// A button has to settle for this long before the change is believed
+#define BUTTON_DEBOUNCE_US 5000
+
+// How often the debug overlay and the stats file are brought up to date
+#define STATS_REFRESH_MS 1000
+#define STATS_SAVE_MS    5000
+#define STATS_LINES      6
+
+extern snd_pcm_t *open_audiofd( char *device_name, int capture, snd_pcm_format_t format, int rate, int channels, int period, int nperiods, int *use_mmap );
 
 int fullScreen = 0;
 int buttonsEnabled = 0;
 int displayUsage = 0;
-char recdir[1024] = {0};
+int showStats = 0;
+char statsPath[1024] = {0};
 char lastRecordedText[1024] = {0};
 
 #ifdef __ARMEL__
@@ -73,6 +104,22 @@ void toggleBacklight() {
     gpioWrite(27, backlight);
 }
 
+// Called from pigpio's own thread whenever a button changes, once the
+// glitch filter is happy with it.  The buttons pull the line low.
+void buttonAlert(int gpio, int level, uint32_t tick, void *data) {
+    struct ButtonMap *button = (struct ButtonMap *)data;
+
+    if ((level == PI_TIMEOUT) || (button->state == level)) return;
+    button->state = level;
+
+    SDL_Event e;
+    memset(&e, 0, sizeof(e));
+    e.type = level == 0 ? SDL_KEYDOWN : SDL_KEYUP;
+    e.key.keysym.sym = button->key;
+    e.key.repeat = 0;
+    SDL_PushEvent(&e);
+}
+
 void initButtons() {
 
     int uid = getuid();
@@ -81,33 +128,16 @@ void initButtons() {
         exit(10);
     }
 
-    gpioInitialise();
+    if (gpioInitialise() < 0) {
+        printf("Error: unable to initialise GPIO.\n");
+        exit(10);
+    }
     for (int i = 0; buttons[i].label != 0; i++) {
         gpioSetMode(buttons[i].gpio, PI_INPUT);
         gpioSetPullUpDown(buttons[i].gpio, PI_PUD_UP);
         buttons[i].state = gpioRead(buttons[i].gpio);
-    }
-}
-
-void mapButtons() {
-    for (int i = 0; buttons[i].label != 0; i++) {
-        int r = gpioRead(buttons[i].gpio);
-        if (buttons[i].state != r) {
-            buttons[i].state = r;
-            if (r == 0) {
-                SDL_Event e;
-                e.type = SDL_KEYDOWN;
-                e.key.keysym.sym = buttons[i].key;
-                e.key.repeat = 0;
-                SDL_PushEvent(&e);
-            } else {
-                SDL_Event e;
-                e.type = SDL_KEYUP;
-                e.key.keysym.sym = buttons[i].key;
-                e.key.repeat = 0;
-                SDL_PushEvent(&e);
-            }
-        }
+        gpioGlitchFilter(buttons[i].gpio, BUTTON_DEBOUNCE_US);
+        gpioSetAlertFuncEx(buttons[i].gpio, buttonAlert, &buttons[i]);
     }
 }
 
@@ -126,9 +156,6 @@ void toggleBacklight() {
 void initButtons() {
 }
 
-void mapButtons() {
-}
-
 void drawButtons() {
 }
 #endif
@@ -143,27 +170,6 @@ SDL_Window *_window;
 SDL_Surface *_display;
 SDL_Surface *_backing;
 
-struct wav {
-	// RIFF header
-	uint32_t riff_chunkid;
-	uint32_t riff_chunksize;
-	uint32_t riff_format;
-
-	// Format header
-	uint32_t fmt_chunkid;
-	uint32_t fmt_chunksize;
-	uint16_t fmt_audioformat;
-	uint16_t fmt_numchannels;
-	uint32_t fmt_samplerate;
-	uint32_t fmt_byterate;
-	uint16_t fmt_blockalign;
-	uint16_t fmt_bitspersample;
-
-	// Data chunk
-	uint32_t data_chunkid;
-	uint32_t data_chunksize;
-};
-
 int quit = 0;
 double resample_mean = 1.0;
 double static_resample_factor = 1.0;
@@ -178,10 +184,24 @@ double offset_integral = 0;
 
 // ------------------------------------------------------ commandline parameters
 
-int sample_rate = 48000;				 /* stream rate */
-int num_channels = 2;				 /* count of channels */
 int period_size = 1024;
 int num_periods = 2;
+int preroll_ms = DEFAULT_PREROLL_MS;
+int use_mmap = 0;
+snd_pcm_format_t capture_format = SND_PCM_FORMAT_S16;
+
+struct CaptureFormat {
+    const char *name;
+    snd_pcm_format_t format;
+};
+
+CaptureFormat captureFormats[] = {
+    { "s16", SND_PCM_FORMAT_S16 },
+    { "s24_3le", SND_PCM_FORMAT_S24_3LE },
+    { "s32", SND_PCM_FORMAT_S32 },
+    { "float", SND_PCM_FORMAT_FLOAT },
+    { NULL, SND_PCM_FORMAT_UNKNOWN }
+};
 
 /**
  * the main function....
@@ -193,27 +213,10 @@ sigterm_handler( int signal )
 	quit = 1;
 }
 
-void sigchld_handler( int signal )
-{
-    int status;
-
-    pid_t pid = wait(&status);
-    printf("Finished with %d: %d\n", pid, status);
-}
-
-int recording = 0;
-int recordingRoomNoise = 0;
-int recordFd = 0;
-uint32_t samples = 0;
-char filename[1024] = {0};
-int firstSample = 0;
-int lastSample = 0;
-
 cmd_ln_t *config = NULL;
 
 TTF_Font *filenameFont;
 
-int segmentNo = 0;
 struct tm *sessionTime;
 
 
@@ -221,48 +224,60 @@ SDL_Color white = {255, 255, 255};
 SDL_Color green = {0, 255, 0};
 SDL_Color yellow = {255, 180, 0};
 
-int noiseFloor = 0;
-
-bool dirExists(const char *path) {
-    DIR *dir = opendir(path);
-    if (!dir) {
+// Copy the current segment's transcript out for the display.
+bool loadSegmentText() {
+    SegmentInfo *seg = manifestSegment(&sessionManifest, segmentNo);
+    if (!seg || !seg->transcript) {
+        lastRecordedText[0] = 0;
         return false;
     }
-    closedir(dir);
+    snprintf(lastRecordedText, sizeof(lastRecordedText), "%s", seg->transcript);
     return true;
 }
 
-bool fileExists(const char *path) {
-    return (access(path, F_OK) != -1);
+// ------------------------------------------------------ screen regions
+
+// Parts of the screen that need redrawing.  Anything that changes what
+// displaySummary() would show marks its region dirty, and refreshScreen()
+// redraws and pushes only those.
+#define DIRTY_TRANSCRIPT 0x01
+#define DIRTY_STATUS     0x02
+#define DIRTY_OVERLAY    0x04
+#define DIRTY_ALL        0xFF
+
+SDL_Rect transcriptRect = { 0, 18, 320, 22 };
+SDL_Rect statusRect = { 0, 48, 320, 62 };
+SDL_Rect overlayRect = { 0, 110, 320, 130 };
+SDL_Rect fullRect = { 0, 0, 320, 240 };
+
+int dirtyRegions = DIRTY_ALL;
+int haveTranscript = 0;
+int unsavedSegment = 0;
+int combineResult = 0;      // 1 when a combine finished, -1 if it failed
+uint32_t redrawAt = 0;
+uint32_t statsDrawAt = 0;
+uint32_t statsSaveAt = 0;
+
+void markDirty(int regions) {
+    dirtyRegions |= regions;
 }
 
-bool loadText(const char *f) {
-    int pos = 0;
-    FILE *file = fopen(f, "r");
-    if (!file) {
-        lastRecordedText[0] = 0;
-        return false;
-    }
-    int c;
-    while ((c = fgetc(file)) != -1) {
-        if (c == '\n') c = ' ';
-        if (c == '\r') c = ' ';
-        lastRecordedText[pos++] = c;
-        lastRecordedText[pos] = 0;
+// Check whether the transcript for the current segment has changed.
+void pollTranscript() {
+    int had = haveTranscript;
+    char old[1024];
+    strcpy(old, lastRecordedText);
+
+    haveTranscript = loadSegmentText();
+
+    if ((had != haveTranscript) || strcmp(old, lastRecordedText)) {
+        markDirty(DIRTY_TRANSCRIPT);
     }
-    fclose(file);
-    return true;
 }
 
-bool loadSegmentText() {
-    char temp[1024];
-    if (recdir[0] == 0) return false;
-    if (filename[0] == 0) return false;
-    sprintf(temp, "%s/%s/segment-%04d.txt", recdir, filename, segmentNo);
-    if (fileExists(temp)) {
-        return loadText(temp);
-    }
-    return false;
+// Bring the summary back after a message has been up for a while.
+void redrawLater(uint32_t ms) {
+    redrawAt = SDL_GetTicks() + ms;
 }
 
 void initSDL() {
@@ -313,6 +328,7 @@ void initSDL() {
     }
 
 	filenameFont = TTF_OpenFontRW(SDL_RWFromConstMem(mainfont, sizeof(mainfont)), 1, 14);
+	initTextCache(filenameFont);
 }
 
 void clearScreen() {
@@ -320,14 +336,21 @@ void clearScreen() {
 }
 
 void text(const char *message, int x, int y, SDL_Color &col) {
-	SDL_Surface *fn = TTF_RenderText_Blended(filenameFont, message, col);
-	SDL_Rect r;
-	r.x = x;
-	r.y = y;
-	r.w = fn->w;
-	r.h = fn->h;
-	SDL_BlitSurface(fn, NULL, _display, &r);
-	SDL_FreeSurface(fn);
+	drawCachedText(_display, message, x, y, col);
+}
+
+// For strings that change from one refresh to the next
+void dynamicText(const char *message, int x, int y, SDL_Color &col) {
+	drawGlyphText(_display, message, x, y, col);
+}
+
+// The debug overlay, where the key help would be
+void drawStats(SDL_Color &col) {
+    char lines[STATS_LINES][STATS_LINE_LEN];
+    int n = statsOverlay(lines, STATS_LINES);
+    for (int i = 0; i < n; i++) {
+        dynamicText(lines[i], 20, 110 + i * 20, col);
+    }
 }
 
 void displaySummary() {
@@ -335,48 +358,18 @@ void displaySummary() {
 //    clearScreen();
 
 
-    if (samples > 0) {
-        int px = 0;
-        int div = samples / 320;
+    if (lastPeaks.frames > 0) {
+        Peak cols[320];
         SDL_Rect r;
 
-        for (int i = 0; i < samples; i += div) {
-            int maxval = 0;
-            int minval = 0;
-            int upav = 0;
-	    int upnum = 0;
-            int downav = 0;
-	    int downnum = 0;
-            for (int j = 0; j < div; j++) {
-		int left = recordingBuffer[(i + j) * 2];
-		int right = recordingBuffer[(i + j) * 2 + 1];
-
-                if (left > maxval) maxval = left;
-		if (right > maxval) maxval = right;
-		if (left < minval) minval = left;
-		if (right < minval) minval = right;
-		if (left > 0) { upav += left; upnum++; }
-		if (left < 0) { downav += left; downnum++; }
-		if (right > 0) { upav += right; upnum++; }
-		if (right < 0) { downav += right; downnum++; }
-            }
-
-	    if (upnum > 0) {
-		    upav /= upnum;
-            } else {
-                    upav = 0;
-            }
-	    if (downnum > 0) {
-		    downav /= downnum;
-            } else {
-                    downav = 0;
-            }
+        peaksRender(&lastPeaks, cols, 320);
 
-            maxval /= 250;
-            minval /= 250;
+        for (int px = 0; px < 320; px++) {
+            int maxval = cols[px].max / 250;
+            int minval = cols[px].min / 250;
 
-            upav /= 250;
-            downav /= 250;
+            int upav = cols[px].up / 250;
+            int downav = cols[px].down / 250;
 
             r.x = px;
             r.w = 1;
@@ -389,30 +382,26 @@ void displaySummary() {
             r.y = 120 - upav;
             r.h = abs(upav - downav) + 1;
             SDL_FillRect(_display, &r, 0xFF4080F0);
-
-            px++;
         }
 
-        r.x = firstSample / div;
+        r.x = lastPeaks.first * 320 / lastPeaks.frames;
         r.y = 120 - 30;
         r.h = 61;
         r.w = 1;
         SDL_FillRect(_display, &r, 0xFF804000);
 
-        r.x = lastSample / div;
+        r.x = lastPeaks.last * 320 / lastPeaks.frames;
         r.y = 120 - 30;
         r.h = 61;
         r.w = 1;
         SDL_FillRect(_display, &r, 0xFF804000);
-
-        
     }
 
-    if (loadSegmentText()) {
+    if (haveTranscript) {
         if (lastRecordedText[0] != 0) {
             int offset = strlen(lastRecordedText) - 45;
             if (offset < 0) offset = 0;
-            text(&lastRecordedText[offset], 20, 20, green);
+            dynamicText(&lastRecordedText[offset], 20, 20, green);
         }
     } else {
         if (!recording) {
@@ -424,16 +413,20 @@ void displaySummary() {
     sprintf(temp, "Session: %s", filename);
     text(temp, 20, 50, white);
     sprintf(temp, "Segments: %d", segmentNo);
-    text(temp, 20, 70, white);
+    dynamicText(temp, 20, 70, white);
     sprintf(temp, "Noise floor: %d", noiseFloor);
-    text(temp, 20, 90, white);
+    dynamicText(temp, 20, 90, white);
 
-    text("Press N to record room noise", 20, 110, white);
-    text("Press C to combine session to WAV", 20, 130, white);
-    text("Press R to record a new segment", 20, 150, white);
-    text("Press D to delete last segment", 20, 170, white);
-    text("Press P to add a marker pulse", 20, 190, white);
-    text("Press Q to quit", 20, 210, white);
+    if (showStats) {
+        drawStats(white);
+    } else {
+        text("Press N to record room noise", 20, 110, white);
+        text("Press C to combine session to WAV", 20, 130, white);
+        text("Press R to record a new segment", 20, 150, white);
+        text("Press D to delete last segment", 20, 170, white);
+        text("Press P to add a marker pulse", 20, 190, white);
+        text("Press Q to quit", 20, 210, white);
+    }
 
 //    updateScreen();
 }
@@ -445,356 +438,231 @@ void updateScreen() {
     }
     SDL_BlitSurface(_display, NULL, _backing, NULL);
     SDL_UpdateWindowSurface(_window);
+    dirtyRegions = 0;
 }
 
-void flushRecordingDevice() {
-    int numSamples = snd_pcm_avail( alsa_handle );
-	if (numSamples == 0) return;
-	if (numSamples > MAX_SAMPLES) numSamples = MAX_SAMPLES;
-    do {
-        snd_pcm_readi( alsa_handle, (char *)&recordingBuffer[0], numSamples);
-        numSamples = snd_pcm_avail( alsa_handle );
-        if (numSamples > MAX_SAMPLES) numSamples = MAX_SAMPLES;
-    } while (numSamples > 0);
-}
-
-void recordRoomNoise() {
-	noiseFloor = 0;
-	samples = 0;
-
-    char temp[1024];
-    sprintf(temp, "%s/%s", recdir, filename);
-
-	mkdir(temp, 0777);
+void refreshScreen() {
+    SDL_Rect rects[3];
+    int n = 0;
 
-	SDL_FillRect(_display, NULL, 0xFFFF0000);
+    if (redrawAt && SDL_TICKS_PASSED(SDL_GetTicks(), redrawAt)) {
+        redrawAt = 0;
+        dirtyRegions = DIRTY_ALL;
+    }
 
-	text("Recording Room Noise. Be Silent!", 20, 20, white);
-	
-    SDL_Delay(100); // Little delay to avoid recording the click.
+    if (dirtyRegions == 0) return;
 
-    flushRecordingDevice();
-	updateScreen();
-	recording = 1;
-	recordingRoomNoise = 1;
-}
-
-void startRecording() {
+    if (dirtyRegions == DIRTY_ALL) {
+        rects[n++] = fullRect;
+    } else {
+        if (dirtyRegions & DIRTY_TRANSCRIPT) rects[n++] = transcriptRect;
+        if (dirtyRegions & DIRTY_STATUS) rects[n++] = statusRect;
+        if (dirtyRegions & DIRTY_OVERLAY) rects[n++] = overlayRect;
+    }
 
-    if (noiseFloor == 0) {
+    // Everything is drawn, but clipped to the regions that changed
+    for (int i = 0; i < n; i++) {
+        SDL_SetClipRect(_display, &rects[i]);
         clearScreen();
-        text("No room noise recorded!", 20, 20, white);
-        updateScreen();
-        return;
+        displaySummary();
+        if (buttonsEnabled) {
+            drawButtons();
+        }
     }
+    SDL_SetClipRect(_display, NULL);
 
-    SDL_Delay(100); // Little delay to avoid recording the click.
+    for (int i = 0; i < n; i++) {
+        SDL_Rect r = rects[i];
+        SDL_BlitSurface(_display, &rects[i], _backing, &r);
+    }
+    SDL_UpdateWindowSurfaceRects(_window, rects, n);
+    dirtyRegions = 0;
+}
 
-    flushRecordingDevice();
-	samples = 0;
+// Show what the recogniser has made of the take so far.
+void showPartialTranscript() {
+    char temp[1024];
+    getPartialTranscript(temp, sizeof(temp));
 
-	segmentNo++;
+    SDL_FillRect(_display, &statusRect, 0xFFFF0000);
+    int offset = strlen(temp) - 45;
+    if (offset < 0) offset = 0;
+    dynamicText(&temp[offset], 20, 50, white);
 
-	char temp[100];
-	sprintf(temp, "Segment %d", segmentNo);
+    SDL_Rect r = statusRect;
+    SDL_BlitSurface(_display, &statusRect, _backing, &r);
+    SDL_UpdateWindowSurfaceRects(_window, &statusRect, 1);
+}
 
-	SDL_FillRect(_display, NULL, 0xFFFF0000);
-	text(temp, 20, 20, white);
+// The summary isn't drawn while recording, so the overlay goes straight
+// onto the recording screen.
+void showStatsWhileRecording() {
+    SDL_FillRect(_display, &overlayRect, 0xFFFF0000);
+    drawStats(white);
 
-	updateScreen();
-	recording = 1;
-	recordingRoomNoise = 0;
+    SDL_Rect r = overlayRect;
+    SDL_BlitSurface(_display, &overlayRect, _backing, &r);
+    SDL_UpdateWindowSurfaceRects(_window, &overlayRect, 1);
 }
 
-int loadFileToBuffer(const char *fn) {
-    int afd = open(fn, O_RDONLY);
-    struct wav header;
-    read(afd, &header, sizeof(header));
-    read(afd, recordingBuffer, header.data_chunksize);
-    close(afd);
-    return header.data_chunksize / 4;
-}
+// Bring the overlay and the stats file up to date when they're due.
+void serviceStats() {
+    uint32_t now = SDL_GetTicks();
 
-void loadRoomNoise() {
-    char temp[1024];
-    sprintf(temp, "%s/%s/room-noise.wav", recdir, filename);
-    samples = loadFileToBuffer(temp);
-    noiseFloor = 0;
-    for (int i = 0; i < samples; i++) {
-        if (abs(recordingBuffer[i * 2]) > noiseFloor) {
-            noiseFloor = abs(recordingBuffer[i * 2]);
+    if (showStats && SDL_TICKS_PASSED(now, statsDrawAt)) {
+        statsDrawAt = now + STATS_REFRESH_MS;
+        if (recording) {
+            showStatsWhileRecording();
+        } else {
+            markDirty(DIRTY_OVERLAY);
         }
-        if (abs(recordingBuffer[i * 2 + 1]) > noiseFloor) {
-            noiseFloor = abs(recordingBuffer[i * 2 + 1]);
+    }
+    if (statsPath[0] && SDL_TICKS_PASSED(now, statsSaveAt)) {
+        statsSaveAt = now + STATS_SAVE_MS;
+        if (!statsWrite(statsPath)) {
+            printf("Unable to write %s\n", statsPath);
         }
     }
-
-    noiseFloor *= 10;
-    noiseFloor /= 9;
 }
 
-void processSpeech(const char *f) {
-
-    ps_decoder_t *ps = NULL;
-    ps = ps_init(config);
-
-    if (!ps) {
-        printf("Error initialising speech system\n");
-        exit(10);
-    }
-    ps_start_utt(ps);
-
-    int s = 0;
-    int i = 0;
-
-    int nsamp = samples / 3;
-
-    int16_t *buf = (int16_t *)alloca(nsamp * 2);
-
-    while (s < samples) {
-        int16_t sval = recordingBuffer[s * 2];
-        s += 3;
-        buf[i++] = sval; 
+void recordRoomNoise() {
+    if (!beginRoomNoise()) {
+        clearScreen();
+        text("Wait for combining to finish", 20, 20, white);
+        updateScreen();
+        redrawLater(1000);
+        return;
     }
-    ps_process_raw(ps, buf, nsamp, FALSE, FALSE);
 
-    ps_end_utt(ps);
+	SDL_FillRect(_display, NULL, 0xFFFF0000);
 
-    int score = 0;
-    const char *out = ps_get_hyp(ps, &score);
+	text("Recording Room Noise. Be Silent!", 20, 20, white);
 
-    FILE *tf = fopen(f, "w");
-    fputs(out, tf);
-    fclose(tf);
-    ps_free(ps);
+	updateScreen();
 }
 
-void stopRecording() {
+void startRecording() {
 
-	firstSample = 0;
-	lastSample = samples - 1;
+    if (noiseFloor == 0) {
+        clearScreen();
+        text("No room noise recorded!", 20, 20, white);
+        updateScreen();
+        redrawLater(1000);
+        return;
+    }
 
-    int validSamples = samples;
+	if (!beginTake()) {
+		clearScreen();
+		text("Unable to create segment file!", 20, 20, white);
+		updateScreen();
+		redrawLater(1000);
+		return;
+	}
 
 	char temp[1024];
-	if (recordingRoomNoise) {
-
-		for (int i = 0; i < samples; i++) {
-			if (abs(recordingBuffer[i * 2]) > noiseFloor) {
-				noiseFloor = abs(recordingBuffer[i * 2]);
-			}
-			if (abs(recordingBuffer[i * 2 + 1]) > noiseFloor) {
-				noiseFloor = abs(recordingBuffer[i * 2 + 1]);
-			}
-		}
-
-        noiseFloor *= 10;
-        noiseFloor /= 9;
-
-		sprintf(temp, "%s/%s/room-noise.wav", recdir, filename);
-
-	} else {
-		sprintf(temp, "%s/%s/segment-%04d.wav", recdir, filename, segmentNo);
-#if 1
-		while (
-			(abs(recordingBuffer[firstSample * 2]) <= noiseFloor) &&
-			(abs(recordingBuffer[firstSample * 2 + 1]) <= noiseFloor) &&
-			(firstSample < lastSample)) {
-				firstSample ++;
-		}
-		while (
-			(abs(recordingBuffer[lastSample * 2]) <= noiseFloor) &&
-			(abs(recordingBuffer[lastSample * 2 + 1]) <= noiseFloor) &&
-			(lastSample > firstSample)) {
-				lastSample --;
-		}
-
-        firstSample -= sample_rate / 10;
-        if (firstSample < 0) firstSample = 0;
-
-        lastSample += sample_rate / 10;
-        if (lastSample > samples - 1) lastSample = samples - 1;
-#endif
-	}
+	sprintf(temp, "Segment %d", segmentNo);
 
-	validSamples = lastSample - firstSample + 1;
-
-	recordFd = open(temp, O_RDWR | O_CREAT, 0666);
-
-	struct wav header;
-	header.riff_chunkid = 0x46464952;
-	header.riff_chunksize = validSamples * 2 * 2 + 36;
-	header.riff_format = 0x45564157;
-
-	header.fmt_chunkid = 0x20746d66;
-	header.fmt_chunksize = 16;
-	header.fmt_audioformat = 1;
-	header.fmt_numchannels =  2;
-	header.fmt_samplerate = sample_rate;
-	header.fmt_byterate = sample_rate * 2 * 2;
-	header.fmt_blockalign = 2 * 2;
-	header.fmt_bitspersample = 16;
-
-	header.data_chunkid = 0x61746164;
-	header.data_chunksize = validSamples * 2 * 2;
-	write(recordFd, &header, sizeof(header));
-
-	write(recordFd, &recordingBuffer[firstSample * 2], validSamples * 4);
-
-	close(recordFd);
-   // displaySummary();
-    
-    if (!recordingRoomNoise) {
-        if (fork() == 0) {
-            sprintf(temp, "%s/%s/segment-%04d.txt", recdir, filename, segmentNo);
-            processSpeech(temp);
-            exit(0);
-        }
-    } 
+	SDL_FillRect(_display, NULL, 0xFFFF0000);
+	dynamicText(temp, 20, 20, white);
 
-	clearScreen();
 	updateScreen();
-
-	samples = 0;
-	recordingRoomNoise = 0;
-	recording = 0;
-
 }
 
-void doRecording() {
+// The take is over, so back to the summary with the new segment's
+// transcript still to come.
+void takeEnded() {
+	haveTranscript = 0;
+	markDirty(DIRTY_ALL);
+}
 
-	if (recordingRoomNoise) {
-		if (samples >= sample_rate * 5) {
-			stopRecording();
-		}
-	}
+void stopRecording() {
+	endTake();
+	takeEnded();
+}
 
-        int numSamples = snd_pcm_avail( alsa_handle );
+// Cut the timeout short if something is due before then
+void wakeBy(uint32_t *timeout, uint32_t at) {
+    uint32_t now = SDL_GetTicks();
+    uint32_t left = SDL_TICKS_PASSED(now, at) ? 0 : at - now;
+    if (left < *timeout) *timeout = left;
+}
 
-	if (numSamples == 0) return;
+// How long the main loop can wait for an event before it has work to do.
+uint32_t loopTimeout() {
+    uint32_t timeout = IDLE_WAKE_MS;
 
-	int samplesLeft = MAX_SAMPLES - samples;
+    if (!recording && redrawAt) {
+        wakeBy(&timeout, redrawAt);
+    }
+    if (showStats) {
+        wakeBy(&timeout, statsDrawAt);
+    }
+    if (statsPath[0]) {
+        wakeBy(&timeout, statsSaveAt);
+    }
+    // doRecording() left some behind, and there won't be another wakeup
+    // from capture until there's room for it
+    if ((ringReadAvail(&captureRing) > 0) && (timeout > BACKLOG_POLL_MS)) {
+        timeout = BACKLOG_POLL_MS;
+    }
+    return timeout;
+}
 
-	if (numSamples > samplesLeft) {
-		numSamples = samplesLeft;
-	}
-	if (recording) {
-		snd_pcm_readi( alsa_handle, (char *)&recordingBuffer[samples * 2], numSamples);
-		samples += numSamples;
-	} else {
-		snd_pcm_readi( alsa_handle, (char *)&recordingBuffer[0], numSamples);
-	}
-	if (samples >= MAX_SAMPLES) {
-		stopRecording();
+void doRecording() {
+	if (collectAudio()) {
+		takeEnded();
 	}
 }
 
 void undoRecording() {
-	char temp[1024];
-	sprintf(temp, "%s/%s/segment-%04d.wav", recdir, filename, segmentNo);
-	unlink(temp);
-	sprintf(temp, "%s/%s/segment-%04d.txt", recdir, filename, segmentNo);
-	unlink(temp);
-	if (segmentNo > 0) {
-		segmentNo--;
+	if (!removeLastTake()) {
+		clearScreen();
+		text("Wait for combining to finish", 20, 20, white);
+		updateScreen();
+		redrawLater(1000);
+		return;
 	}
-	clearScreen();
-	updateScreen();
+	pollTranscript();
+	markDirty(DIRTY_ALL);
 }
 
-int addRoomNoise(int fd, int seconds, int16_t *roomNoiseSamples) {
-    int len = sample_rate * seconds;
-    int maxsamp = sample_rate * 5 - len;
+// A segment the writer couldn't save and how a combine went, held back
+// until the recording screen is out of the way.
+void reportHeld() {
+	int y = 20;
+	uint32_t ms = 1000;
 
-    int pos = rand() % maxsamp;
-    
-	write(fd, &roomNoiseSamples[pos * 2], sample_rate * 4 * seconds);
-	return sample_rate * seconds;
-}
-
-int appendFile(int fd, const char *fn) {
-	int afd = open(fn, O_RDONLY);
-	struct wav header;
-	read(afd, &header, sizeof(header));
-	read(afd, recordingBuffer, header.data_chunksize);
-	write(fd, recordingBuffer, header.data_chunksize);
-	close(afd);
-	return header.data_chunksize / 4;
+	clearScreen();
+	if (unsavedSegment) {
+		char temp[64];
+		sprintf(temp, "Segment %d was not saved!", unsavedSegment);
+		dynamicText(temp, 20, y, white);
+		y += 20;
+		ms = 2000;
+		unsavedSegment = 0;
+	}
+	if (combineResult) {
+		text(combineResult > 0 ? "Combining complete." : "Combining failed!", 20, y, white);
+		combineResult = 0;
+	}
+	updateScreen();
+	redrawLater(ms);
 }
 
 void combineSession() {
 	clearScreen();
-	text("Combining session...", 20, 20, white);
-	updateScreen();
-
-	char temp[1024];
-
-	int16_t roomNoiseSamples[sample_rate * 5 * 2];
 
-	sprintf(temp, "%s/%s/room-noise.wav", recdir, filename);
-	int fd = open(temp, O_RDONLY);
-	lseek(fd, 44, SEEK_SET);
-	read(fd, roomNoiseSamples, sample_rate * 5 * 2 * 2);
-	close(fd);
-
-	sprintf(temp, "%s/%s.wav", recdir, filename);
-	int masterFd = open(temp, O_RDWR | O_CREAT, 0666);
-
-	struct wav header;
-
-	header.riff_chunkid = 0x46464952;
-	header.riff_chunksize = 0; //samples * 2 * 2 + 36;
-	header.riff_format = 0x45564157;
-
-	header.fmt_chunkid = 0x20746d66;
-	header.fmt_chunksize = 16;
-	header.fmt_audioformat = 1;
-	header.fmt_numchannels =  2;
-	header.fmt_samplerate = sample_rate;
-	header.fmt_byterate = sample_rate * 2 * 2;
-	header.fmt_blockalign = 2 * 2;
-	header.fmt_bitspersample = 16;
-
-	header.data_chunkid = 0x61746164;
-	header.data_chunksize = 0; //samples * 2 * 2;
-
-	write(masterFd, &header, sizeof(header));
-	int nsamp = 0;
-
-	nsamp += addRoomNoise(masterFd, 2, roomNoiseSamples);
-
-	for (int i = 1; i <= segmentNo; i++) {
-		sprintf(temp, "%s/%s/segment-%04d.wav", recdir, filename, i);
-		nsamp += appendFile(masterFd, temp);
-		nsamp += addRoomNoise(masterFd, 1, roomNoiseSamples);
+	if (combineBusy()) {
+		text("Already combining...", 20, 20, white);
+	} else if (combineCurrentSession()) {
+		text("Combining session...", 20, 20, white);
+	} else {
+		text("Unable to combine session!", 20, 20, white);
+		redrawLater(1000);
 	}
-
-	lseek(masterFd, 0, SEEK_SET);
-	header.riff_chunksize = nsamp * 2 * 2 + 36;
-	header.data_chunksize = nsamp * 2 * 2;
-	write(masterFd, &header, sizeof(header));
-	close(masterFd);
-
-	clearScreen();
-	text("Combining complete.", 20, 20, white);
 	updateScreen();
 }
 
-void reopenSession() {
-    int fd;
-    segmentNo = 1;
-
-    loadRoomNoise();
-
-    char temp[1024];
-    sprintf(temp, "%s/%s/segment-%04d.wav", recdir, filename, segmentNo);
-    while (fileExists(temp)) {
-        segmentNo++;
-        sprintf(temp, "%s/%s/segment-%04d.wav", recdir, filename, segmentNo);
-    }
-    segmentNo--;
-}
-
 void displayHelpMessage() {
     printf("Usage: abook-recorder [options]\n");
     printf("  Options:\n");
@@ -802,6 +670,16 @@ void displayHelpMessage() {
     printf("      -n <name>         - Name the session\n");
     printf("      -f                - Full screen\n");
     printf("      -b                - Enable GPIO buttons (Pi only)\n");
+    printf("      -m                - Read the capture device through mmap rather than\n");
+    printf("                          read calls (audio is still copied into the ring)\n");
+    printf("      -F <format>       - Capture format: s16, s24_3le, s32 or float\n");
+    printf("      -p <frames>       - Period size (default 1024)\n");
+    printf("      -P <count>        - Number of periods (default 2)\n");
+    printf("      -l <ms>           - Audio to keep from before R is pressed (default %d)\n", DEFAULT_PREROLL_MS);
+    printf("      -o <wav|flac>     - Format of the combined session\n");
+    printf("      -L <lufs>         - Normalise the combined session, e.g. -L -18\n");
+    printf("      -D                - Show capture stats in place of the key help\n");
+    printf("      -s <file>         - Write capture stats to a file every few seconds\n");
 }
 
 void getRecDir() {
@@ -818,16 +696,14 @@ void getRecDir() {
 }
 
 void addPulseFile() {
-    segmentNo++;
-    int i = 0;
-    for (samples = 0; samples < (sample_rate / 10); samples++) {
-        recordingBuffer[i++] = 32767;
-        recordingBuffer[i++] = 32767;
-        recordingBuffer[i++] = -32768;
-        recordingBuffer[i++] = -32768;
+    if (!addPulse()) {
+        clearScreen();
+        text("Unable to add a pulse!", 20, 20, white);
+        updateScreen();
+        redrawLater(1000);
+        return;
     }
-    recording = 1;
-    stopRecording();
+    takeEnded();
 }
 
 int main (int argc, char *argv[]) {
@@ -838,10 +714,9 @@ int main (int argc, char *argv[]) {
     int errflg=0;
     int c;
 
-    time_t ts = time(NULL);
 
 
-    while ((c = getopt(argc, argv, "hbfd:n:r:R:")) != -1) {
+    while ((c = getopt(argc, argv, "hbfmDd:n:r:R:o:L:F:p:P:s:l:")) != -1) {
         switch(c) {
             case 'd':
                 strcpy(alsa_device,optarg);
@@ -855,6 +730,15 @@ int main (int argc, char *argv[]) {
             case 'b':
                 buttonsEnabled++;
                 break;
+            case 'm':
+                use_mmap = 1;
+                break;
+            case 'D':
+                showStats = 1;
+                break;
+            case 's':
+                snprintf(statsPath, sizeof(statsPath), "%s", optarg);
+                break;
             case 'h':
                 displayUsage++;
                 break;
@@ -866,15 +750,71 @@ int main (int argc, char *argv[]) {
                 sample_rate = atoi(optarg);
                 break;
 
+            case 'F':
+                capture_format = SND_PCM_FORMAT_UNKNOWN;
+                for (int i = 0; captureFormats[i].name; i++) {
+                    if (!strcasecmp(optarg, captureFormats[i].name)) {
+                        capture_format = captureFormats[i].format;
+                    }
+                }
+                if (capture_format == SND_PCM_FORMAT_UNKNOWN) {
+                    printf("Unknown sample format %s\n", optarg);
+                    displayUsage++;
+                }
+                break;
+
+            case 'p':
+                period_size = atoi(optarg);
+                if ((period_size < 16) || (period_size > 65536)) {
+                    printf("Period size should be between 16 and 65536 frames\n");
+                    displayUsage++;
+                }
+                break;
+
+            case 'P':
+                num_periods = atoi(optarg);
+                if ((num_periods < 2) || (num_periods > 64)) {
+                    printf("Period count should be between 2 and 64\n");
+                    displayUsage++;
+                }
+                break;
+
+            case 'l':
+                preroll_ms = atoi(optarg);
+                if ((preroll_ms < 0) || (preroll_ms > MAX_PREROLL_MS)) {
+                    printf("Pre-roll should be between 0 and %dms\n", MAX_PREROLL_MS);
+                    displayUsage++;
+                }
+                break;
+
+            case 'o':
+                if (!strcasecmp(optarg, "wav")) {
+                    exportFormat = COMBINE_WAV;
+                } else if (!strcasecmp(optarg, "flac")) {
+                    exportFormat = COMBINE_FLAC;
+                } else {
+                    printf("Unknown output format %s\n", optarg);
+                    displayUsage++;
+                }
+                break;
+
+            case 'L':
+                exportLoudness = atof(optarg);
+                if ((exportLoudness >= 0) || (exportLoudness < LOUDNESS_GATE)) {
+                    printf("Loudness target should be between %.0f and 0 LUFS\n", LOUDNESS_GATE);
+                    displayUsage++;
+                }
+                break;
+
             default:
                 displayUsage++;
                 break;
         }
     }
 
-    recordingBuffer = (int16_t *)malloc(MAX_SAMPLES * 4);
+    initKernels();
 
-    if (!recordingBuffer) {
+    if (!initSession()) {
         printf("Unable to allocate recording buffer!\n");
         exit(10);
     }
@@ -893,7 +833,10 @@ int main (int argc, char *argv[]) {
         sprintf(temp, "%s/%s/room-noise.wav", recdir, filename);
         int fd;
         if (fileExists(temp)) {
-            reopenSession();
+            if (!reopenSession()) {
+                exit(10);
+            }
+            haveTranscript = loadSegmentText();
         }
     } else {
         time_t t = time(NULL);
@@ -905,26 +848,35 @@ int main (int argc, char *argv[]) {
     }
 
 
-    config = cmd_ln_init(NULL, ps_args(), TRUE,
-		         "-hmm", "/usr/share/sphinx-voxforge-en/hmm/voxforge_en_sphinx.cd_cont_3000/",
-	             "-lm", "/usr/share/sphinx-voxforge-en/lm/voxforge_en_sphinx.cd_cont_3000/voxforge_en_sphinx.lm.DMP",
-	             "-dict", "/usr/share/sphinx-voxforge-en/lm/voxforge_en_sphinx.cd_cont_3000/voxforge_en_sphinx.dic",
-	             NULL);
+    config = defaultRecognizerConfig();
 
     if (!config) {
         printf("Error creating speech config\n");
         exit(10);
     }
 
+    if (!startRecognizer(config, sample_rate, num_channels)) {
+        exit(10);
+    }
+
 
 
-    alsa_handle = open_audiofd( alsa_device, 1, sample_rate, num_channels, period_size, num_periods);
+    alsa_handle = open_audiofd( alsa_device, 1, capture_format, sample_rate, num_channels, period_size, num_periods, &use_mmap);
     if( alsa_handle == 0 )
 	exit(20);
 
+    if (!initSegmentWriter(sample_rate, num_channels)) {
+        printf("Unable to start segment writer!\n");
+        exit(10);
+    }
+
+    setCapturePreroll((uint64_t)sample_rate * preroll_ms / 1000);
+    if (!startCapture(alsa_handle, capture_format, num_channels, CAPTURE_RING_SAMPLES, use_mmap)) {
+        exit(20);
+    }
+
     signal( SIGTERM, sigterm_handler );
     signal( SIGINT, sigterm_handler );
-    signal( SIGCHLD, sigchld_handler );
 
     if (buttonsEnabled) {
         initButtons();
@@ -942,16 +894,42 @@ int main (int argc, char *argv[]) {
 
     while (quit == 0) {
 
-    if (buttonsEnabled) {
-        mapButtons();
-    }
-
 	SDL_Event event;
-	while (SDL_PollEvent(&event)) {
+	for (int have = SDL_WaitEventTimeout(&event, loopTimeout()); have; have = SDL_PollEvent(&event)) {
 		switch (event.type) {
 			case SDL_QUIT:
 				quit = 1;
 				break;
+			case SDL_USEREVENT:
+				switch (event.user.code) {
+					case EVENT_AUDIO:
+						// Picked up by doRecording() below
+						captureWakeupSeen();
+						break;
+					case EVENT_TRANSCRIPT:
+						readTranscript((intptr_t)event.user.data1);
+						if ((intptr_t)event.user.data1 == segmentNo) {
+							pollTranscript();
+						}
+						break;
+					case EVENT_COMBINED:
+						// Shown below, or once the take is over
+						combineResult = event.user.data1 ? 1 : -1;
+						break;
+					case EVENT_SEGMENT:
+						// Safely on disk; nothing more to show
+						break;
+					case EVENT_SEGMENT_FAILED:
+						unsavedSegment = (intptr_t)event.user.data1;
+						break;
+					case EVENT_PARTIAL:
+						if (recording && !recordingRoomNoise &&
+							((intptr_t)event.user.data1 == segmentNo)) {
+							showPartialTranscript();
+						}
+						break;
+				}
+				break;
 			case SDL_KEYDOWN:
 				if (event.key.repeat == 0) {
 					switch (event.key.keysym.sym) {
@@ -975,7 +953,8 @@ int main (int argc, char *argv[]) {
                             toggleBacklight();
                             break;
                         case SDLK_p:
-                            addPulseFile();
+                            if (!recording)
+                                addPulseFile();
                             break;
 					}
 				}
@@ -999,15 +978,13 @@ int main (int argc, char *argv[]) {
 	}
 
 	doRecording();
-
-	SDL_Delay(1);
+	serviceStats();
 
     if (!recording) {
-        if (time(NULL) - ts >= 1) {
-            ts = time(NULL);
-            clearScreen();
-            updateScreen();
+        if (unsavedSegment || combineResult) {
+            reportHeld();
         }
+        refreshScreen();
     }
 
 
@@ -1017,7 +994,16 @@ int main (int argc, char *argv[]) {
 		stopRecording();
 	}
 
+    stopCapture();
+    shutdownSegmentWriter();
+    stopRecognizer();
+    waitForCombine();
+
+    if (statsPath[0] && !statsWrite(statsPath)) {
+        printf("Unable to write %s\n", statsPath);
+    }
 
+	freeTextCache();
 	SDL_DestroyWindow(_window);
 
     SDL_Quit();
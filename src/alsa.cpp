@@ -29,7 +29,7 @@ snd_pcm_uframes_t real_period_size;
 
 // Alsa stuff... i dont want to touch this bullshit in the next years.... please...
 
-static int xrun_recovery(snd_pcm_t *handle, int err) {
+int xrun_recovery(snd_pcm_t *handle, int err) {
 //    printf( "xrun !!!.... %d\n", err );
 	if (err == -EPIPE) {	/* under-run */
 		err = snd_pcm_prepare(handle);
@@ -49,12 +49,12 @@ static int xrun_recovery(snd_pcm_t *handle, int err) {
 	return err;
 }
 
-static int set_hwformat( snd_pcm_t *handle, snd_pcm_hw_params_t *params )
+static int set_hwformat( snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_format_t format )
 {
-	return snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16);
+	return snd_pcm_hw_params_set_format(handle, params, format);
 }
 
-static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_access_t access, int rate, int channels, int period, int nperiods ) {
+static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_access_t access, snd_pcm_format_t format, int rate, int channels, int period, int nperiods ) {
 	int err, dir=0;
 	unsigned int buffer_time;
 	unsigned int period_time;
@@ -75,9 +75,9 @@ static int set_hwparams(snd_pcm_t *handle, snd_pcm_hw_params_t *params, snd_pcm_
 	}
 
 	/* set the sample format */
-	err = set_hwformat(handle, params);
+	err = set_hwformat(handle, params, format);
 	if (err < 0) {
-		printf("Sample format not available for playback: %s\n", snd_strerror(err));
+		printf("Sample format %s not available: %s\n", snd_pcm_format_name(format), snd_strerror(err));
 		return err;
 	}
 	/* set the count of channels */
@@ -155,7 +155,7 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams, int pe
 		return err;
 	}
 	/* allow the transfer when at least period_size samples can be processed */
-	err = snd_pcm_sw_params_set_avail_min(handle, swparams, 2*period );
+	err = snd_pcm_sw_params_set_avail_min(handle, swparams, period );
 	if (err < 0) {
 		printf("Unable to set avail min for capture: %s\n", snd_strerror(err));
 		return err;
@@ -177,8 +177,11 @@ static int set_swparams(snd_pcm_t *handle, snd_pcm_sw_params_t *swparams, int pe
 
 // ok... i only need this function to communicate with the alsa bloat api...
 
-snd_pcm_t *open_audiofd( char *device_name, int capture, int rate, int channels, int period, int nperiods ) {
-  int err;
+// If *use_mmap is set, the device is opened for mmap access where it can
+// be, and *use_mmap is left saying whether it was.
+
+snd_pcm_t *open_audiofd( char *device_name, int capture, snd_pcm_format_t format, int rate, int channels, int period, int nperiods, int *use_mmap ) {
+  int err = -1;
   snd_pcm_t *handle;
   snd_pcm_hw_params_t *hwparams;
   snd_pcm_sw_params_t *swparams;
@@ -191,7 +194,14 @@ snd_pcm_t *open_audiofd( char *device_name, int capture, int rate, int channels,
       return NULL;
   }
 
-  if ((err = set_hwparams(handle, hwparams,SND_PCM_ACCESS_RW_INTERLEAVED, rate, channels, period, nperiods )) < 0) {
+  if (*use_mmap) {
+      err = set_hwparams(handle, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED, format, rate, channels, period, nperiods );
+      if (err < 0) {
+          printf("No mmap access to %s, using read access instead\n", device_name);
+          *use_mmap = 0;
+      }
+  }
+  if (!*use_mmap && (err = set_hwparams(handle, hwparams,SND_PCM_ACCESS_RW_INTERLEAVED, format, rate, channels, period, nperiods )) < 0) {
       printf("Setting of hwparams failed: %s\n", snd_strerror(err));
       return NULL;
   }
@@ -0,0 +1,533 @@
+/** @file bench.cpp
+ *
+ * @brief Headless replay of a scripted session, timing each stage of the
+ * recording pipeline with no capture device or screen.
+ *
+ * The script has one command per line:
+ *
+ *     noise [file.wav]             record room noise
+ *     take [file.wav] [seconds]    record a take, ten seconds by default
+ *     delete                       undo the last take
+ *     pulse                        add a sync pulse
+ *     combine                      combine the session and wait for it
+ *     repeat <n> <command>         do a command n times
+ *
+ * Without a file, noise and takes are made up (see source.h).  A file is
+ * looped if the take is longer than it is.  # starts a comment.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <SDL2/SDL.h>
+#include "capture.h"
+#include "source.h"
+#include "segwriter.h"
+#include "combine.h"
+#include "recognizer.h"
+#include "loudness.h"
+#include "kernels.h"
+#include "session.h"
+#include "events.h"
+
+#define CAPTURE_RING_SAMPLES (sample_rate * 4)
+#define DEFAULT_TAKE_SECONDS 10.0
+#define MAX_WAV_SOURCES 16
+#define MAX_PENDING 1024
+#define MAX_PREROLL_MS 2000
+#define MIN_RATE 8000
+#define MAX_RATE 192000
+
+// Give up on the recogniser if it goes this long without finishing one
+#define TRANSCRIPT_TIMEOUT_MS 60000
+
+struct Stat {
+    const char *name;
+    uint32_t count;
+    double total;       // ms
+    double max;
+};
+
+enum {
+    STAT_CAPTURE,
+    STAT_TRIM,
+    STAT_PEAKS,
+    STAT_WRITE,
+    STAT_FINISH,
+    STAT_FLUSH,
+    STAT_STREAM,
+    STAT_TRANSCRIBE,
+    STAT_COMBINE,
+    STAT_COUNT
+};
+
+Stat stats[STAT_COUNT] = {
+    { "capture" },      // cue to the last frame being taken off the ring
+    { "trim" },
+    { "peaks" },        // waveform summary and levels
+    { "write" },        // handing blocks to the writer thread
+    { "finish" },       // handing the file over at the end of a take
+    { "flush" },        // end of a take to its file being safely on disk
+    { "stream" },       // resampling for the recogniser
+    { "transcribe" },   // end of a take to its transcript
+    { "combine" },
+};
+
+// Takes waiting for something to finish, and when they ended
+struct Pending {
+    int segment;
+    uint64_t ended;
+};
+
+AudioSource noiseSource;
+AudioSource speechSource;
+AudioSource wavSources[MAX_WAV_SOURCES];
+char wavPaths[MAX_WAV_SOURCES][1024];
+int wavSourceCount = 0;
+
+Pending pending[MAX_PENDING];
+int pendingCount = 0;
+Pending unflushed[MAX_PENDING];
+int unflushedCount = 0;
+int failedFiles = 0;
+
+int transcribe = 0;
+int combineDone = 0;
+int combineOk = 0;
+int takes = 0;
+uint64_t audioFrames = 0;
+double speed = 0;
+uint32_t prerollFrames = 0;
+
+static double ms(uint64_t ticks) {
+    return ticks * 1000.0 / SDL_GetPerformanceFrequency();
+}
+
+static void addStat(int stat, double value) {
+    Stat *s = &stats[stat];
+    s->count++;
+    s->total += value;
+    if (value > s->max) s->max = value;
+}
+
+static void addPending(Pending *list, int *count, int segment) {
+    if (*count == MAX_PENDING) return;
+    list[*count].segment = segment;
+    list[*count].ended = SDL_GetPerformanceCounter();
+    (*count)++;
+}
+
+static void pendingDone(Pending *list, int *count, int segment, int stat) {
+    for (int i = 0; i < *count; i++) {
+        if (list[i].segment != segment) continue;
+        addStat(stat, ms(SDL_GetPerformanceCounter() - list[i].ended));
+        memmove(&list[i], &list[i + 1], (*count - i - 1) * sizeof(Pending));
+        (*count)--;
+        return;
+    }
+}
+
+// Forget a take that won't be finishing after all
+static void pendingDrop(Pending *list, int *count, int segment) {
+    for (int i = 0; i < *count; i++) {
+        if (list[i].segment != segment) continue;
+        memmove(&list[i], &list[i + 1], (*count - i - 1) * sizeof(Pending));
+        (*count)--;
+        return;
+    }
+}
+
+// Handle whatever turns up within timeout ms, then empty the ring.
+// Returns false if nothing turned up at all.
+static bool pump(uint32_t timeout) {
+    SDL_Event event;
+    bool any = false;
+
+    for (int have = SDL_WaitEventTimeout(&event, timeout); have; have = SDL_PollEvent(&event)) {
+        any = true;
+        if (event.type != SDL_USEREVENT) continue;
+        switch (event.user.code) {
+            case EVENT_AUDIO:
+                captureWakeupSeen();
+                break;
+            case EVENT_TRANSCRIPT:
+                readTranscript((intptr_t)event.user.data1);
+                pendingDone(pending, &pendingCount, (intptr_t)event.user.data1, STAT_TRANSCRIBE);
+                break;
+            case EVENT_SEGMENT_FAILED:
+                failedFiles++;
+                // fall through
+            case EVENT_SEGMENT:
+                pendingDone(unflushed, &unflushedCount, (intptr_t)event.user.data1, STAT_FLUSH);
+                break;
+            case EVENT_COMBINED:
+                combineDone = 1;
+                combineOk = (intptr_t)event.user.data1;
+                break;
+        }
+    }
+    collectAudio();
+    return any;
+}
+
+static bool waitForTranscripts() {
+    while (pendingCount > 0) {
+        if (!pump(TRANSCRIPT_TIMEOUT_MS)) {
+            printf("Gave up waiting for %d transcripts\n", pendingCount);
+            pendingCount = 0;
+            return false;
+        }
+    }
+    return true;
+}
+
+static AudioSource *findSource(const char *path, AudioSource *synth) {
+    if (!path) {
+        sourceRewind(synth);
+        return synth;
+    }
+    for (int i = 0; i < wavSourceCount; i++) {
+        if (!strcmp(wavPaths[i], path)) {
+            sourceRewind(&wavSources[i]);
+            return &wavSources[i];
+        }
+    }
+    if (wavSourceCount == MAX_WAV_SOURCES) {
+        printf("Too many different files\n");
+        return NULL;
+    }
+    if (!sourceOpenWav(&wavSources[wavSourceCount], path, sample_rate, num_channels)) {
+        return NULL;
+    }
+    snprintf(wavPaths[wavSourceCount], sizeof(wavPaths[0]), "%s", path);
+    return &wavSources[wavSourceCount++];
+}
+
+// Feed the source through whatever's being recorded until it's all gone,
+// or the room noise fills up.
+static void play(AudioSource *src, uint32_t frames) {
+    cueCapture(src, frames);
+    while (recording) {
+        pump(ringReadAvail(&captureRing) > 0 ? 1 : 100);
+        if ((captureCueLeft() == 0) && (ringReadAvail(&captureRing) == 0)) break;
+    }
+}
+
+// Play the start of the source while capture is idle, as the moments
+// before the key goes down would be, so there's a pre-roll to begin with.
+static void fillPreroll(AudioSource *src) {
+    if (prerollFrames == 0) return;
+    cueCapture(src, prerollFrames);
+    while (captureCueLeft() > 0) {
+        pump(1);
+    }
+    audioFrames += prerollFrames;
+}
+
+static bool doNoise(const char *path) {
+    AudioSource *src = findSource(path, &noiseSource);
+    if (!src) return false;
+
+    fillPreroll(src);
+    uint64_t t0 = SDL_GetPerformanceCounter();
+    if (!beginRoomNoise()) {
+        printf("Unable to record room noise\n");
+        return false;
+    }
+    play(src, ROOM_NOISE_SAMPLES + KEY_CLICK);
+    if (recording) endTake();
+    addStat(STAT_CAPTURE, ms(SDL_GetPerformanceCounter() - t0));
+    audioFrames += ROOM_NOISE_SAMPLES;
+    return true;
+}
+
+static bool doTake(const char *path, double seconds) {
+    if (noiseFloor == 0) {
+        printf("No room noise recorded\n");
+        return false;
+    }
+    AudioSource *src = findSource(path, &speechSource);
+    if (!src) return false;
+
+    uint32_t frames = seconds * sample_rate;
+    if (seconds <= 0) {
+        frames = path ? src->view.frames : DEFAULT_TAKE_SECONDS * sample_rate;
+    }
+
+    fillPreroll(src);
+    uint64_t t0 = SDL_GetPerformanceCounter();
+    if (!beginTake()) {
+        printf("Unable to create segment file\n");
+        return false;
+    }
+    play(src, frames);
+    addStat(STAT_CAPTURE, ms(SDL_GetPerformanceCounter() - t0));
+
+    int segment = segmentNo;
+    endTake();
+
+    addStat(STAT_TRIM, ms(takeTimes.trim));
+    addStat(STAT_PEAKS, ms(takeTimes.peaks));
+    addStat(STAT_WRITE, ms(takeTimes.write));
+    addStat(STAT_FINISH, ms(takeTimes.close));
+    addStat(STAT_STREAM, ms(takeTimes.recognise));
+
+    addPending(unflushed, &unflushedCount, segment);
+    if (transcribe) {
+        addPending(pending, &pendingCount, segment);
+    }
+    takes++;
+    audioFrames += frames;
+    return true;
+}
+
+static bool doCombine() {
+    uint64_t t0 = SDL_GetPerformanceCounter();
+    combineDone = 0;
+    if (!combineCurrentSession()) {
+        printf("Unable to combine session\n");
+        return false;
+    }
+    while (!combineDone) {
+        pump(100);
+    }
+    addStat(STAT_COMBINE, ms(SDL_GetPerformanceCounter() - t0));
+    if (!combineOk) {
+        printf("Combining failed\n");
+        return false;
+    }
+    return true;
+}
+
+static bool runCommand(char **words, int count) {
+    if (count == 0) return true;
+
+    if (!strcmp(words[0], "repeat") && (count > 2)) {
+        int n = atoi(words[1]);
+        for (int i = 0; i < n; i++) {
+            if (!runCommand(&words[2], count - 2)) return false;
+        }
+        return true;
+    }
+
+    // The optional arguments: a file, and for takes a length
+    const char *path = NULL;
+    double seconds = 0;
+    for (int i = 1; i < count; i++) {
+        int len = strlen(words[i]);
+        if ((len > 4) && !strcasecmp(&words[i][len - 4], ".wav")) {
+            path = words[i];
+        } else {
+            seconds = atof(words[i]);
+        }
+    }
+
+    if (!strcmp(words[0], "noise")) {
+        return doNoise(path);
+    } else if (!strcmp(words[0], "take")) {
+        return doTake(path, seconds);
+    } else if (!strcmp(words[0], "delete")) {
+        // Its recognition is cancelled, so no transcript will turn up
+        int segment = segmentNo;
+        if (!removeLastTake()) return false;
+        pendingDrop(pending, &pendingCount, segment);
+        return true;
+    } else if (!strcmp(words[0], "pulse")) {
+        return addPulse();
+    } else if (!strcmp(words[0], "combine")) {
+        return doCombine();
+    }
+    printf("Unknown command %s\n", words[0]);
+    return false;
+}
+
+static bool runScript(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        printf("Unable to open %s\n", path);
+        return false;
+    }
+
+    char line[1024];
+    int lineNo = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), f)) {
+        lineNo++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = 0;
+
+        char *words[16];
+        int count = 0;
+        for (char *w = strtok(line, " \t\r\n"); w && (count < 16); w = strtok(NULL, " \t\r\n")) {
+            words[count++] = w;
+        }
+        ok = runCommand(words, count);
+        if (!ok) printf("%s:%d: stopped\n", path, lineNo);
+    }
+    fclose(f);
+    return ok;
+}
+
+static void report(double seconds) {
+    double audio = (double)audioFrames / sample_rate;
+    printf("%d takes, %.1fs of audio in %.2fs (%.1fx real time)\n",
+           takes, audio, seconds, seconds > 0 ? audio / seconds : 0);
+    if (captureDropped) {
+        printf("%u frames dropped\n", captureDropped);
+    }
+    if (failedFiles) {
+        printf("%d segments couldn't be written\n", failedFiles);
+    }
+
+    printf("%-12s %8s %12s %10s %10s\n", "stage", "count", "total ms", "mean ms", "max ms");
+    for (int i = 0; i < STAT_COUNT; i++) {
+        Stat *s = &stats[i];
+        if (s->count == 0) continue;
+        printf("%-12s %8u %12.1f %10.3f %10.3f\n", s->name, s->count, s->total, s->total / s->count, s->max);
+    }
+}
+
+void displayHelpMessage() {
+    printf("Usage: abook-bench [options] <script>\n");
+    printf("  Options:\n");
+    printf("      -r <dir>          - Directory to record the session in (default .)\n");
+    printf("      -n <name>         - Name the session (default bench)\n");
+    printf("      -R <rate>         - Sample rate (default 48000)\n");
+    printf("      -x <speed>        - Play at this many times real time (default 0, flat out)\n");
+    printf("      -t                - Transcribe the takes\n");
+    printf("      -l <ms>           - Pre-roll to play before each take (default 0)\n");
+    printf("      -o <wav|flac>     - Format of the combined session\n");
+    printf("      -L <lufs>         - Normalise the combined session, e.g. -L -18\n");
+}
+
+int main(int argc, char *argv[]) {
+    int displayUsage = 0;
+    int prerollMs = 0;
+    int c;
+
+    strcpy(recdir, ".");
+    strcpy(filename, "bench");
+
+    while ((c = getopt(argc, argv, "htr:n:R:x:o:L:l:")) != -1) {
+        switch (c) {
+            case 'r':
+                snprintf(recdir, sizeof(recdir), "%s", optarg);
+                break;
+            case 'n':
+                snprintf(filename, sizeof(filename), "%s", optarg);
+                break;
+            case 'R':
+                sample_rate = atoi(optarg);
+                if ((sample_rate < MIN_RATE) || (sample_rate > MAX_RATE)) {
+                    printf("Sample rate should be between %d and %d\n", MIN_RATE, MAX_RATE);
+                    displayUsage++;
+                }
+                break;
+            case 'x':
+                speed = atof(optarg);
+                if (speed < 0) displayUsage++;
+                break;
+            case 't':
+                transcribe = 1;
+                break;
+            case 'l':
+                prerollMs = atoi(optarg);
+                if ((prerollMs < 0) || (prerollMs > MAX_PREROLL_MS)) {
+                    printf("Pre-roll should be between 0 and %dms\n", MAX_PREROLL_MS);
+                    displayUsage++;
+                }
+                break;
+            case 'o':
+                if (!strcasecmp(optarg, "wav")) {
+                    exportFormat = COMBINE_WAV;
+                } else if (!strcasecmp(optarg, "flac")) {
+                    exportFormat = COMBINE_FLAC;
+                } else {
+                    printf("Unknown output format %s\n", optarg);
+                    displayUsage++;
+                }
+                break;
+            case 'L':
+                exportLoudness = atof(optarg);
+                if ((exportLoudness >= 0) || (exportLoudness < LOUDNESS_GATE)) {
+                    printf("Loudness target should be between %.0f and 0 LUFS\n", LOUDNESS_GATE);
+                    displayUsage++;
+                }
+                break;
+            default:
+                displayUsage++;
+                break;
+        }
+    }
+
+    if (optind != argc - 1) {
+        displayUsage++;
+    }
+
+    if (displayUsage) {
+        displayHelpMessage();
+        exit(0);
+    }
+
+    char temp[1024];
+    snprintf(temp, sizeof(temp), "%s/%s", recdir, filename);
+    if (dirExists(temp)) {
+        printf("%s already exists\n", temp);
+        exit(10);
+    }
+
+    initKernels();
+    if (!initSession()) {
+        printf("Unable to allocate recording buffer!\n");
+        exit(10);
+    }
+
+    SDL_SetHintWithPriority(SDL_HINT_NO_SIGNAL_HANDLERS, "1", SDL_HINT_OVERRIDE);
+    if (SDL_Init(SDL_INIT_EVENTS) < 0) {
+        printf("Unable to start SDL: %s\n", SDL_GetError());
+        exit(10);
+    }
+
+    if (transcribe) {
+        cmd_ln_t *config = defaultRecognizerConfig();
+        if (!config || !startRecognizer(config, sample_rate, num_channels)) {
+            printf("Error creating speech config\n");
+            exit(10);
+        }
+    }
+
+    if (!initSegmentWriter(sample_rate, num_channels)) {
+        printf("Unable to start segment writer!\n");
+        exit(10);
+    }
+
+    sourceOpenSynth(&noiseSource, SOURCE_NOISE, sample_rate, num_channels);
+    sourceOpenSynth(&speechSource, SOURCE_SPEECH, sample_rate, num_channels);
+    prerollFrames = (uint64_t)sample_rate * prerollMs / 1000;
+    setCapturePreroll(prerollFrames);
+    if (!startSourceCapture(num_channels, CAPTURE_RING_SAMPLES, speed)) {
+        exit(20);
+    }
+
+    uint64_t t0 = SDL_GetPerformanceCounter();
+    bool ok = runScript(argv[optind]);
+    waitForTranscripts();
+    waitForSegmentFiles();
+    pump(0);
+    double seconds = ms(SDL_GetPerformanceCounter() - t0) / 1000;
+
+    stopCapture();
+    shutdownSegmentWriter();
+    stopRecognizer();
+    waitForCombine();
+
+    for (int i = 0; i < wavSourceCount; i++) {
+        sourceClose(&wavSources[i]);
+    }
+
+    report(seconds);
+    SDL_Quit();
+    exit(ok ? 0 : 1);
+}
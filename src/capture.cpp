@@ -0,0 +1,486 @@
+/** @file capture.cpp
+ *
+ * @brief Real-time capture thread.  It does nothing but pull periods
+ * out of ALSA and push them into a lock-free ring so that slow UI work
+ * on the main thread can never stall the device, then wakes the main
+ * loop to come and get them.  The same thread can be fed from an
+ * AudioSource instead of a device.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <SDL2/SDL.h>
+#include <alsa/asoundlib.h>
+#include "kernels.h"
+#include "events.h"
+#include "source.h"
+#include "capture.h"
+#include "stats.h"
+
+extern int xrun_recovery(snd_pcm_t *handle, int err);
+
+RingBuffer captureRing;
+volatile uint32_t captureDropped = 0;
+
+static snd_pcm_t *captureHandle = NULL;
+static SDL_Thread *captureThread = NULL;
+static volatile int captureRunning = 0;
+static char *stagingBuffer = NULL;
+static bool captureMmap = false;
+static snd_pcm_format_t captureFormat = SND_PCM_FORMAT_S16;
+static int captureChannels = 2;
+static int captureIdle = 1;
+static int wakePending = 0;
+static int wakePipe[2] = { -1, -1 };
+
+// The last few moments heard while idle, already S16, to go in front of
+// whatever's recorded next.  Only the capture thread touches it once it
+// has been allocated.
+static int16_t *preroll = NULL;
+static uint32_t prerollSize = 0;
+static uint32_t prerollPos = 0;     // where the next frame goes
+static uint32_t prerollFill = 0;
+static uint32_t prerollLead = 0;    // frames it put at the front of the ring
+
+// For filling the ring from a source rather than a device
+static double sourceSpeed = 0;
+static AudioSource *cueSource = NULL;
+static uint32_t cueLeft = 0;
+
+#define STAGING_FRAMES 1024
+#define SOURCE_BLOCK_FRAMES 1024
+
+// Bring frames in the device's format into the ring as S16
+static void convertFrames(const void *in, int16_t *out, uint32_t frames) {
+    size_t count = (size_t)frames * captureChannels;
+
+    switch (captureFormat) {
+        case SND_PCM_FORMAT_S24_3LE:
+            s24ToS16((const uint8_t *)in, out, count);
+            break;
+        case SND_PCM_FORMAT_S32:
+            s32ToS16((const int32_t *)in, out, count);
+            break;
+        case SND_PCM_FORMAT_FLOAT:
+            f32ToS16((const float *)in, out, count);
+            break;
+        default:
+            memcpy(out, in, count * sizeof(int16_t));
+            break;
+    }
+}
+
+// Keep the newest frames heard while idle, overwriting the oldest.
+static void prerollAdd(const char *in, uint32_t frames) {
+    if (prerollSize == 0) return;
+
+    size_t frameBytes = captureChannels * (snd_pcm_format_physical_width(captureFormat) / 8);
+    if (frames > prerollSize) {
+        in += (frames - prerollSize) * frameBytes;
+        frames = prerollSize;
+    }
+    while (frames > 0) {
+        uint32_t n = prerollSize - prerollPos;
+        if (n > frames) n = frames;
+        convertFrames(in, &preroll[prerollPos * captureChannels], n);
+        in += n * frameBytes;
+        frames -= n;
+        prerollPos = (prerollPos + n) % prerollSize;
+        prerollFill += n;
+    }
+    if (prerollFill > prerollSize) prerollFill = prerollSize;
+}
+
+// Capture has just gone active: start the ring off with the pre-roll,
+// oldest first.  The count is published before any of it is, so whoever
+// sees the frames also sees how many there were.
+static uint32_t deliverPreroll() {
+    uint32_t n = prerollFill;
+    uint32_t space = ringWriteSpace(&captureRing);
+    if (n > space) n = space;
+    __atomic_store_n(&prerollLead, n, __ATOMIC_RELAXED);
+    prerollFill = 0;
+    if (n == 0) return 0;
+
+    uint32_t from = (prerollPos + prerollSize - n) % prerollSize;
+    uint32_t left = n;
+    while (left > 0) {
+        int16_t *ptr;
+        uint32_t count = ringWritePtr(&captureRing, &ptr);
+        if (count > left) count = left;
+        if (count > prerollSize - from) count = prerollSize - from;
+        memcpy(ptr, &preroll[from * captureChannels], count * captureChannels * sizeof(int16_t));
+        ringCommitWrite(&captureRing, count);
+        from = (from + count) % prerollSize;
+        left -= count;
+    }
+    return n;
+}
+
+// Only the one wakeup at a time; the main loop empties the ring after
+// acknowledging it, so nothing is missed.
+static void wakeMainLoop() {
+    if (!__atomic_exchange_n(&wakePending, 1, __ATOMIC_ACQ_REL)) {
+        pushUserEvent(EVENT_AUDIO, 0);
+    }
+}
+
+// Anything xrun_recovery() can't deal with (the device going away, say)
+// would otherwise have the thread spinning.
+static void recover(int err) {
+    if (err == -EPIPE) {
+        statsCount(&captureStats.xruns);
+    } else if (err == -ESTRPIPE) {
+        statsCount(&captureStats.suspends);
+    } else {
+        statsCount(&captureStats.errors);
+    }
+    if (xrun_recovery(captureHandle, err) < 0) {
+        SDL_Delay(100);
+    }
+    snd_pcm_start(captureHandle);
+}
+
+// Returns the number of frames put in the ring.  If keep isn't set
+// nothing wants them, so they're all just drained into the pre-roll.
+static uint32_t readFrames(snd_pcm_sframes_t avail, bool keep) {
+    uint32_t kept = 0;
+
+    while (avail > 0) {
+        int16_t *ptr = NULL;
+        uint32_t space = keep ? ringWritePtr(&captureRing, &ptr) : 0;
+
+        // The consumer has fallen behind.  Keep ALSA drained so the
+        // device itself doesn't overrun, and count what we lose.
+        if (space == 0) {
+            snd_pcm_sframes_t n = avail > STAGING_FRAMES ? STAGING_FRAMES : avail;
+            n = snd_pcm_readi(captureHandle, stagingBuffer, n);
+            if (n == -EAGAIN) break;
+            if (n < 0) {
+                recover(n);
+                break;
+            }
+            if (keep) {
+                captureDropped += n;
+            } else {
+                prerollAdd(stagingBuffer, n);
+            }
+            avail -= n;
+            continue;
+        }
+
+        // S16 can go straight in; anything else is read aside first
+        if (space > avail) space = avail;
+        snd_pcm_sframes_t n;
+        if (captureFormat == SND_PCM_FORMAT_S16) {
+            n = snd_pcm_readi(captureHandle, ptr, space);
+        } else {
+            if (space > STAGING_FRAMES) space = STAGING_FRAMES;
+            n = snd_pcm_readi(captureHandle, stagingBuffer, space);
+            if (n > 0) convertFrames(stagingBuffer, ptr, n);
+        }
+        if (n == -EAGAIN) break;
+        if (n < 0) {
+            recover(n);
+            break;
+        }
+        if ((uint32_t)n < space) statsCount(&captureStats.shortReads);
+        ringCommitWrite(&captureRing, n);
+        kept += n;
+        avail -= n;
+    }
+    return kept;
+}
+
+// The same, but the frames come straight out of the driver's buffer
+// rather than through a read call, and frames that won't fit are just
+// let go without being touched.  They're still copied into the ring, as
+// that's what keeps a slow main loop from overrunning the device.
+static uint32_t mapFrames(snd_pcm_sframes_t avail, bool keep) {
+    uint32_t kept = 0;
+
+    while (avail > 0) {
+        int16_t *ptr = NULL;
+        uint32_t space = keep ? ringWritePtr(&captureRing, &ptr) : 0;
+
+        const snd_pcm_channel_area_t *areas;
+        snd_pcm_uframes_t offset;
+        snd_pcm_uframes_t frames = avail;
+        int err = snd_pcm_mmap_begin(captureHandle, &areas, &offset, &frames);
+        if (err < 0) {
+            recover(err);
+            break;
+        }
+
+        const char *src = (const char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8;
+        if (space > 0) {
+            if (frames > space) frames = space;
+            convertFrames(src, ptr, frames);
+        } else if (!keep) {
+            prerollAdd(src, frames);
+        }
+
+        snd_pcm_sframes_t n = snd_pcm_mmap_commit(captureHandle, offset, frames);
+        if ((n < 0) || ((snd_pcm_uframes_t)n != frames)) {
+            recover(n < 0 ? n : -EPIPE);
+            break;
+        }
+        if (space > 0) {
+            ringCommitWrite(&captureRing, n);
+            kept += n;
+        } else if (keep) {
+            captureDropped += n;
+        }
+        avail -= n;
+    }
+    return kept;
+}
+
+// Sleeps in poll() on the device's descriptors and the wakeup pipe, so
+// it only runs when there's a period to collect or it's being stopped.
+static int captureMain(void *arg) {
+    SDL_SetThreadPriority(SDL_THREAD_PRIORITY_TIME_CRITICAL);
+
+    int count = snd_pcm_poll_descriptors_count(captureHandle);
+    struct pollfd *fds = (struct pollfd *)calloc(count + 1, sizeof(struct pollfd));
+    if ((count <= 0) || !fds) {
+        printf("Unable to get capture poll descriptors\n");
+        free(fds);
+        return 0;
+    }
+    snd_pcm_poll_descriptors(captureHandle, fds, count);
+    fds[count].fd = wakePipe[0];
+    fds[count].events = POLLIN;
+
+    uint64_t frequency = SDL_GetPerformanceFrequency();
+    uint64_t lastWake = 0;
+    bool wasIdle = true;
+
+    while (captureRunning) {
+        if (poll(fds, count + 1, -1) < 0) {
+            if (errno != EINTR) SDL_Delay(10);
+            continue;
+        }
+        if (fds[count].revents) {
+            char buf[16];
+            while (read(wakePipe[0], buf, sizeof(buf)) > 0) { }
+            continue;
+        }
+
+        unsigned short revents = 0;
+        snd_pcm_poll_descriptors_revents(captureHandle, fds, count, &revents);
+        if (!(revents & (POLLIN | POLLERR))) continue;
+
+        // An overrun shows up here as an error
+        snd_pcm_sframes_t avail = snd_pcm_avail_update(captureHandle);
+        if (avail < 0) {
+            recover(avail);
+            continue;
+        }
+
+        uint64_t now = SDL_GetPerformanceCounter();
+        if (lastWake) statsHistogram(captureStats.wakeGaps, (now - lastWake) * 1000000 / frequency);
+        lastWake = now;
+        statsHistogram(captureStats.readFrames, avail);
+
+        bool keep = !__atomic_load_n(&captureIdle, __ATOMIC_RELAXED);
+        uint32_t kept = (keep && wasIdle) ? deliverPreroll() : 0;
+        wasIdle = !keep;
+        kept += captureMmap ? mapFrames(avail, keep) : readFrames(avail, keep);
+
+        if (kept) {
+            statsPeak(&captureStats.ringPeak, ringReadAvail(&captureRing));
+            wakeMainLoop();
+        }
+    }
+
+    free(fds);
+    return 0;
+}
+
+// Sleep until the time is up or someone writes to the wakeup pipe.
+static void sleepCapture(int ms) {
+    struct pollfd fd;
+    fd.fd = wakePipe[0];
+    fd.events = POLLIN;
+    if (poll(&fd, 1, ms) > 0) {
+        char buf[16];
+        while (read(wakePipe[0], buf, sizeof(buf)) > 0) { }
+    }
+}
+
+// Plays whatever has been cued, a block at a time.  Rather than drop
+// anything it waits for the main loop to make room, and at any speed
+// other than 0 it also keeps to that many times real time.
+static int sourceMain(void *arg) {
+    bool cued = false;
+    uint64_t cueStart = 0;
+    uint64_t cueDone = 0;
+    uint64_t frequency = SDL_GetPerformanceFrequency();
+    bool wasIdle = true;
+
+    while (captureRunning) {
+        uint32_t left = __atomic_load_n(&cueLeft, __ATOMIC_ACQUIRE);
+        if (left == 0) {
+            cued = false;
+            sleepCapture(-1);
+            continue;
+        }
+        AudioSource *src = cueSource;
+        if (!cued) {
+            cued = true;
+            cueStart = SDL_GetPerformanceCounter();
+            cueDone = 0;
+        }
+
+        if (sourceSpeed > 0) {
+            uint64_t due = cueStart + (uint64_t)(cueDone * frequency / (src->rate * sourceSpeed));
+            uint64_t now = SDL_GetPerformanceCounter();
+            if (now < due) {
+                sleepCapture((int)((due - now) * 1000 / frequency) + 1);
+                continue;
+            }
+        }
+
+        uint32_t n = left > SOURCE_BLOCK_FRAMES ? SOURCE_BLOCK_FRAMES : left;
+        bool keep = !__atomic_load_n(&captureIdle, __ATOMIC_RELAXED);
+        if (keep && wasIdle) deliverPreroll();
+        wasIdle = !keep;
+        if (keep) {
+            int16_t *ptr;
+            uint32_t space = ringWritePtr(&captureRing, &ptr);
+            if (space == 0) {
+                sleepCapture(1);
+                continue;
+            }
+            if (n > space) n = space;
+            sourceRead(src, ptr, n);
+            ringCommitWrite(&captureRing, n);
+            statsPeak(&captureStats.ringPeak, ringReadAvail(&captureRing));
+        } else {
+            sourceRead(src, (int16_t *)stagingBuffer, n);
+            prerollAdd(stagingBuffer, n);
+        }
+        cueDone += n;
+        __atomic_store_n(&cueLeft, left - n, __ATOMIC_RELEASE);
+
+        if (keep) wakeMainLoop();
+    }
+    return 0;
+}
+
+static bool startThread(SDL_ThreadFunction fn) {
+    if (pipe(wakePipe) < 0) {
+        printf("Unable to create capture wakeup pipe!\n");
+        return false;
+    }
+    fcntl(wakePipe[0], F_SETFL, O_NONBLOCK);
+
+    if (prerollSize > 0) {
+        preroll = (int16_t *)malloc(prerollSize * captureChannels * sizeof(int16_t));
+        if (!preroll) {
+            printf("Unable to allocate capture pre-roll!\n");
+            return false;
+        }
+    }
+    prerollPos = 0;
+    prerollFill = 0;
+    prerollLead = 0;
+
+    captureIdle = 1;
+    wakePending = 0;
+    captureRunning = 1;
+    captureThread = SDL_CreateThread(fn, "capture", NULL);
+    if (!captureThread) {
+        printf("Unable to start capture thread: %s\n", SDL_GetError());
+        captureRunning = 0;
+        return false;
+    }
+    return true;
+}
+
+bool startCapture(snd_pcm_t *handle, snd_pcm_format_t format, int channels, uint32_t ringFrames, bool mmap) {
+    if (!ringInit(&captureRing, ringFrames, channels)) {
+        printf("Unable to allocate capture ring!\n");
+        return false;
+    }
+    captureFormat = format;
+    captureChannels = channels;
+    stagingBuffer = (char *)malloc(STAGING_FRAMES * channels * (snd_pcm_format_physical_width(format) / 8));
+    if (!stagingBuffer) {
+        printf("Unable to allocate capture staging buffer!\n");
+        return false;
+    }
+
+    captureHandle = handle;
+    captureMmap = mmap;
+    return startThread(captureMain);
+}
+
+bool startSourceCapture(int channels, uint32_t ringFrames, double speed) {
+    if (!ringInit(&captureRing, ringFrames, channels)) {
+        printf("Unable to allocate capture ring!\n");
+        return false;
+    }
+    captureChannels = channels;
+    stagingBuffer = (char *)malloc(SOURCE_BLOCK_FRAMES * channels * sizeof(int16_t));
+    if (!stagingBuffer) {
+        printf("Unable to allocate capture staging buffer!\n");
+        return false;
+    }
+    sourceSpeed = speed;
+    cueSource = NULL;
+    cueLeft = 0;
+    return startThread(sourceMain);
+}
+
+void cueCapture(AudioSource *src, uint32_t frames) {
+    cueSource = src;
+    __atomic_store_n(&cueLeft, frames, __ATOMIC_RELEASE);
+    if (write(wakePipe[1], "", 1) < 0) {
+        printf("Unable to wake capture thread\n");
+    }
+}
+
+uint32_t captureCueLeft() {
+    return __atomic_load_n(&cueLeft, __ATOMIC_ACQUIRE);
+}
+
+void stopCapture() {
+    if (!captureThread) return;
+    captureRunning = 0;
+    if (write(wakePipe[1], "", 1) < 0) {
+        printf("Unable to wake capture thread\n");
+    }
+    SDL_WaitThread(captureThread, NULL);
+    captureThread = NULL;
+    close(wakePipe[0]);
+    close(wakePipe[1]);
+    wakePipe[0] = wakePipe[1] = -1;
+    free(stagingBuffer);
+    stagingBuffer = NULL;
+    free(preroll);
+    preroll = NULL;
+    ringFree(&captureRing);
+}
+
+void setCapturePreroll(uint32_t frames) {
+    prerollSize = frames;
+}
+
+uint32_t capturePrerollFrames() {
+    return __atomic_load_n(&prerollLead, __ATOMIC_RELAXED);
+}
+
+void setCaptureIdle(bool idle) {
+    if (!idle) __atomic_store_n(&prerollLead, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&captureIdle, idle ? 1 : 0, __ATOMIC_RELAXED);
+}
+
+void captureWakeupSeen() {
+    __atomic_store_n(&wakePending, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,50 @@
+#ifndef _CAPTURE_H
+#define _CAPTURE_H
+
+#include <alsa/asoundlib.h>
+#include "ringbuffer.h"
+
+struct AudioSource;
+
+// Audio captured by the capture thread, waiting for the main loop.
+extern RingBuffer captureRing;
+
+// Frames thrown away because the ring was full.
+extern volatile uint32_t captureDropped;
+
+// The device can be in any of S16, S24_3LE, S32 or FLOAT; the ring is
+// always S16.  With mmap set the handle must have been opened for mmap
+// access, and frames are then converted straight out of the driver's
+// buffer into the ring.  That's still one copy per frame, the same as a
+// read makes for S16; only the other formats save their staging copy.
+bool startCapture(snd_pcm_t *handle, snd_pcm_format_t format, int channels, uint32_t ringFrames, bool mmap);
+
+// Or the ring can be filled from AudioSources (see source.h), a stretch
+// at a time.  Nothing is dropped; the thread waits for there to be room
+// instead.  It runs at speed times real time, or as fast as it can for 0.
+bool startSourceCapture(int channels, uint32_t ringFrames, double speed);
+
+// Play the next frames frames of src.  The last cue must have run out.
+void cueCapture(AudioSource *src, uint32_t frames);
+uint32_t captureCueLeft();
+
+void stopCapture();
+
+// Capture starts out idle, dealing with the audio itself rather than
+// waking anyone for it.  Otherwise it posts EVENT_AUDIO when there's
+// something in the ring; the main loop calls captureWakeupSeen() before
+// emptying it, and there won't be another event until it has.
+void setCaptureIdle(bool idle);
+void captureWakeupSeen();
+
+// While idle the last frames frames are kept back, and the ring starts
+// with them when capture goes active again, so a take can begin from
+// just before it was asked for.  Set before starting capture; 0 (the
+// default) keeps nothing.
+void setCapturePreroll(uint32_t frames);
+
+// How many frames at the front of the ring came from the pre-roll.  Only
+// meaningful once something has turned up after going active.
+uint32_t capturePrerollFrames();
+
+#endif
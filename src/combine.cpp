@@ -0,0 +1,786 @@
+/** @file combine.cpp
+ *
+ * @brief Assembly of a session into a single WAV or FLAC file.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+#include <FLAC/stream_encoder.h>
+#include "kernels.h"
+#include "loudness.h"
+#include "wavfile.h"
+#include "filecopy.h"
+#include "events.h"
+#include "manifest.h"
+#include "combine.h"
+#include "stats.h"
+
+#define PIECE_NOISE     0
+#define PIECE_SEGMENT   1
+
+#define FLAC_BLOCK_FRAMES   4096
+#define SCALE_BLOCK_FRAMES  4096
+#define FLAC_COMPRESSION    5
+
+#define STATE_MAGIC     "ABOOK-COMBINE"
+#define STATE_VERSION   2
+
+// One contiguous run of the output file.
+struct CombinePiece {
+    int kind;
+    int segment;
+    off_t outPos;
+    uint32_t frames;
+    uint32_t noiseStart;    // first room noise frame to use
+};
+
+static char combineDir[1024];
+static char combineOut[1024];
+static int combineSegments = 0;
+static uint32_t *combineFrames = NULL;     // 1..combineSegments
+static int combineRate = 48000;
+static int combineFormat = COMBINE_WAV;
+static double combineLoudness = 0;
+static int combineGainTenths = 0;          // in tenths of a dB
+static float combineGain = 1.0f;
+
+static SDL_Thread *combineThread = NULL;
+static int combineActive = 0;
+static int combineFailed = 0;
+
+static struct WavView roomNoise;
+static CombinePiece *pieces = NULL;
+static int pieceCount = 0;
+static int nextPiece = 0;
+static int nextMeasure = 0;
+static int16_t flacScaled[FLAC_BLOCK_FRAMES * 2];
+
+// Enough about a file to tell whether it's been touched since.
+struct FileStamp {
+    int64_t size;           // -1 if it wasn't there
+    int64_t sec;
+    long nsec;
+};
+
+// What the last successful combine put in the output file.
+struct CombineState {
+    int rate;
+    int segments;
+    int gain;               // tenths of a dB
+    FileStamp output;
+    FileStamp noise;
+    FileStamp *segment;     // 1..segments
+};
+
+static CombineState lastState;
+static CombineState newState;
+
+static bool pwriteAll(int fd, const void *buffer, size_t len, off_t pos) {
+    const char *p = (const char *)buffer;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void segmentPath(char *path, int segment) {
+    sprintf(path, "%s/segment-%04d.wav", combineDir, segment);
+}
+
+static void statePath(char *path) {
+    sprintf(path, "%s/combine.state", combineDir);
+}
+
+static void stampFile(const char *path, FileStamp *stamp) {
+    struct stat sb;
+    if (stat(path, &sb) < 0) {
+        stamp->size = -1;
+        stamp->sec = 0;
+        stamp->nsec = 0;
+        return;
+    }
+    stamp->size = sb.st_size;
+    stamp->sec = sb.st_mtim.tv_sec;
+    stamp->nsec = sb.st_mtim.tv_nsec;
+}
+
+static bool sameStamp(FileStamp *a, FileStamp *b) {
+    return (a->size == b->size) && (a->sec == b->sec) && (a->nsec == b->nsec);
+}
+
+static bool olderStamp(FileStamp *a, FileStamp *b) {
+    return (a->sec < b->sec) || ((a->sec == b->sec) && (a->nsec < b->nsec));
+}
+
+static void freeState(CombineState *state) {
+    free(state->segment);
+    memset(state, 0, sizeof(CombineState));
+}
+
+static bool readStamp(FILE *f, const char *tag, FileStamp *stamp) {
+    char name[32];
+    long long size, sec;
+    long nsec;
+    if (fscanf(f, "%31s %lld %lld %ld", name, &size, &sec, &nsec) != 4) return false;
+    if (strcmp(name, tag)) return false;
+    stamp->size = size;
+    stamp->sec = sec;
+    stamp->nsec = nsec;
+    return true;
+}
+
+static bool loadState(CombineState *state) {
+    char path[1100];
+    char magic[32];
+    int version;
+
+    memset(state, 0, sizeof(CombineState));
+    statePath(path);
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+
+    bool ok = (fscanf(f, "%31s %d", magic, &version) == 2) &&
+        !strcmp(magic, STATE_MAGIC) && (version == STATE_VERSION) &&
+        (fscanf(f, " rate %d segments %d gain %d", &state->rate, &state->segments, &state->gain) == 3) &&
+        (state->segments >= 0) &&
+        readStamp(f, "output", &state->output) &&
+        readStamp(f, "noise", &state->noise);
+
+    if (ok) {
+        state->segment = (FileStamp *)calloc(state->segments + 1, sizeof(FileStamp));
+        ok = state->segment != NULL;
+    }
+    for (int i = 1; ok && (i <= state->segments); i++) {
+        ok = readStamp(f, "segment", &state->segment[i]);
+    }
+    fclose(f);
+
+    if (!ok) freeState(state);
+    return ok;
+}
+
+// Written under another name and renamed, so it's either all there or
+// not at all.
+static bool saveState(CombineState *state) {
+    char path[1100];
+    char temp[1110];
+
+    statePath(path);
+    sprintf(temp, "%s.tmp", path);
+    FILE *f = fopen(temp, "w");
+    if (!f) return false;
+
+    fprintf(f, "%s %d\n", STATE_MAGIC, STATE_VERSION);
+    fprintf(f, "rate %d segments %d gain %d\n", state->rate, state->segments, state->gain);
+    fprintf(f, "output %lld %lld %ld\n", (long long)state->output.size,
+        (long long)state->output.sec, state->output.nsec);
+    fprintf(f, "noise %lld %lld %ld\n", (long long)state->noise.size,
+        (long long)state->noise.sec, state->noise.nsec);
+    for (int i = 1; i <= state->segments; i++) {
+        fprintf(f, "segment %lld %lld %ld\n", (long long)state->segment[i].size,
+            (long long)state->segment[i].sec, state->segment[i].nsec);
+    }
+
+    bool ok = !ferror(f);
+    ok = (fclose(f) == 0) && ok;
+    if (ok) ok = rename(temp, path) == 0;
+    if (!ok) unlink(temp);
+    return ok;
+}
+
+// The output can be extended if nothing that went into it has changed
+// since, it's at the same level, and there are at least as many segments
+// now as there were.
+static bool canAppend(CombineState *last, CombineState *now) {
+    if ((last->rate != now->rate) || (last->segments > now->segments)) return false;
+    if (last->gain != now->gain) return false;
+    if (!sameStamp(&last->output, &now->output)) return false;
+    if (!sameStamp(&last->noise, &now->noise)) return false;
+    for (int i = 1; i <= last->segments; i++) {
+        if (!sameStamp(&last->segment[i], &now->segment[i])) return false;
+    }
+    return true;
+}
+
+static void addNoise(uint32_t frames, off_t *pos) {
+    CombinePiece *p = &pieces[pieceCount++];
+    p->kind = PIECE_NOISE;
+    p->outPos = *pos;
+    p->frames = frames;
+
+    // A stretch from somewhere random in the room noise recording
+    uint32_t avail = roomNoise.samples ? roomNoise.frames : 0;
+    p->noiseStart = avail > frames ? rand() % (avail - frames) : 0;
+    *pos += (off_t)frames * 4;
+}
+
+// Work out where everything from segment first on goes, given that the
+// output already holds existing bytes of samples.  The lengths all come
+// from the manifest, so no segment has to be opened for this.
+static bool layoutSession(int first, uint64_t existing, uint64_t *totalBytes) {
+    off_t pos = sizeof(struct wav) + existing;
+
+    pieces = (CombinePiece *)calloc(1 + (combineSegments - first + 1) * 2, sizeof(CombinePiece));
+    if (!pieces) return false;
+    pieceCount = 0;
+
+    if (first == 1) {
+        addNoise(combineRate * COMBINE_LEAD_IN_SECONDS, &pos);
+    }
+
+    for (int i = first; i <= combineSegments; i++) {
+        if (combineFrames[i] > 0) {
+            CombinePiece *p = &pieces[pieceCount++];
+            p->kind = PIECE_SEGMENT;
+            p->segment = i;
+            p->outPos = pos;
+            p->frames = combineFrames[i];
+            pos += (off_t)combineFrames[i] * 4;
+        }
+        addNoise(combineRate * COMBINE_GAP_SECONDS, &pos);
+    }
+
+    *totalBytes = pos - sizeof(struct wav);
+    return true;
+}
+
+// Open a segment and check it's what the manifest says it is
+static bool openSegment(struct WavView *view, int segment, uint32_t frames) {
+    char path[1100];
+    segmentPath(path, segment);
+
+    if (!wavOpen(view, path)) return false;
+    if ((view->channels != 2) || (view->rate != combineRate) || (view->frames < frames)) {
+        printf("%s: doesn't match the session manifest\n", path);
+        wavClose(view);
+        return false;
+    }
+    return true;
+}
+
+// Write frames out at the output level
+static bool writeSamples(int fd, const int16_t *samples, uint32_t frames, off_t pos) {
+    if (combineGainTenths == 0) {
+        return pwriteAll(fd, samples, (size_t)frames * 4, pos);
+    }
+
+    int16_t buffer[SCALE_BLOCK_FRAMES * 2];
+    while (frames > 0) {
+        uint32_t n = frames > SCALE_BLOCK_FRAMES ? SCALE_BLOCK_FRAMES : frames;
+        s16Scale(samples, buffer, n * 2, combineGain);
+        if (!pwriteAll(fd, buffer, n * 4, pos)) return false;
+        samples += n * 2;
+        pos += n * 4;
+        frames -= n;
+    }
+    return true;
+}
+
+static bool writeNoise(int fd, CombinePiece *p) {
+    uint32_t avail = roomNoise.samples ? roomNoise.frames : 0;
+    off_t pos = p->outPos;
+    uint32_t done = 0;
+
+    // Nothing to pick from; the file was sized up front, so the hole
+    // already reads back as silence.
+    if (avail == 0) return true;
+
+    uint32_t from = p->noiseStart;
+    while (done < p->frames) {
+        uint32_t n = avail - from;
+        if (n > p->frames - done) n = p->frames - done;
+        if (!writeSamples(fd, &roomNoise.samples[from * 2], n, pos)) return false;
+        pos += n * 4;
+        done += n;
+        from = 0;
+    }
+    return true;
+}
+
+static bool writeSegment(int fd, CombinePiece *p) {
+    struct WavView view;
+    if (!openSegment(&view, p->segment, p->frames)) return false;
+
+    // At the recorded level it can go across without being looked at
+    if (combineGainTenths != 0) {
+        bool ok = writeSamples(fd, view.samples, p->frames, p->outPos);
+        wavClose(&view);
+        return ok;
+    }
+
+    uint64_t len = (uint64_t)p->frames * 4;
+    uint64_t got = copyFileData(fd, p->outPos, view.fd, view.dataOffset, len);
+    wavClose(&view);
+
+    if (got < len) {
+        printf("Short copy from segment %d\n", p->segment);
+        return false;
+    }
+    return true;
+}
+
+// One thread per CPU, up to a limit, but no more than there are jobs
+static int poolSize(int jobs) {
+    int threads = SDL_GetCPUCount();
+    if (threads > COMBINE_MAX_THREADS) threads = COMBINE_MAX_THREADS;
+    if (threads > jobs) threads = jobs;
+    if (threads < 1) threads = 1;
+    return threads;
+}
+
+// Run fn on each thread with its own entry from args, if there are any.
+// The workers share the jobs out between themselves.
+static void runPool(SDL_ThreadFunction fn, void **args, int threads) {
+    SDL_Thread *workers[COMBINE_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < threads; i++) {
+        workers[started] = SDL_CreateThread(fn, "combine", args ? args[started] : NULL);
+        if (workers[started]) started++;
+    }
+
+    // If no threads could be had at all, do the lot here
+    if (started == 0) {
+        fn(args ? args[0] : NULL);
+    }
+    for (int i = 0; i < started; i++) {
+        SDL_WaitThread(workers[i], NULL);
+    }
+}
+
+static int combineWorker(void *arg) {
+    // Each worker has its own descriptor so none of them share a position
+    int fd = open(combineOut, O_WRONLY);
+    if (fd < 0) {
+        printf("Unable to open %s: %s\n", combineOut, strerror(errno));
+        __atomic_store_n(&combineFailed, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    while (1) {
+        int i = __atomic_fetch_add(&nextPiece, 1, __ATOMIC_RELAXED);
+        if (i >= pieceCount) break;
+
+        CombinePiece *p = &pieces[i];
+        bool ok = p->kind == PIECE_SEGMENT ? writeSegment(fd, p) : writeNoise(fd, p);
+        if (!ok) {
+            __atomic_store_n(&combineFailed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+// Build or extend the WAV file, filling it in from the worker pool.
+static void combineWav() {
+    char path[1100];
+    uint64_t total = 0;
+    uint64_t existing = 0;
+    int first = 1;
+    int fd = -1;
+
+    // Take stock of everything that goes into the output
+    memset(&newState, 0, sizeof(CombineState));
+    newState.rate = combineRate;
+    newState.segments = combineSegments;
+    newState.gain = combineGainTenths;
+    newState.segment = (FileStamp *)calloc(combineSegments + 1, sizeof(FileStamp));
+    stampFile(combineOut, &newState.output);
+    sprintf(path, "%s/room-noise.wav", combineDir);
+    stampFile(path, &newState.noise);
+    for (int i = 1; newState.segment && (i <= combineSegments); i++) {
+        segmentPath(path, i);
+        stampFile(path, &newState.segment[i]);
+    }
+
+    // Only the new segments need adding if the last combine is intact
+    if (newState.segment && loadState(&lastState) && canAppend(&lastState, &newState)) {
+        first = lastState.segments + 1;
+        existing = newState.output.size - sizeof(struct wav);
+    }
+    freeState(&lastState);
+
+    if (!newState.segment || !layoutSession(first, existing, &total)) {
+        printf("Out of memory\n");
+        combineFailed = 1;
+    } else if (total > 0xFFFFFFFFULL - 36) {
+        printf("Session is too long for a WAV file\n");
+        combineFailed = 1;
+    } else {
+        // Until this run finishes the state no longer describes the file
+        statePath(path);
+        unlink(path);
+
+        fd = open(combineOut, O_RDWR | O_CREAT | (first == 1 ? O_TRUNC : 0), 0666);
+        if ((fd < 0) || (ftruncate(fd, sizeof(struct wav) + total) < 0)) {
+            printf("Unable to create %s: %s\n", combineOut, strerror(errno));
+            combineFailed = 1;
+        }
+    }
+
+    if (!combineFailed) {
+        nextPiece = 0;
+        runPool(combineWorker, NULL, poolSize(pieceCount));
+    }
+
+    if (!combineFailed) {
+        struct wav header;
+        fillWavHeader(&header, combineRate, total / 4);
+        if (!pwriteAll(fd, &header, sizeof(header), 0)) {
+            printf("Error writing %s: %s\n", combineOut, strerror(errno));
+            combineFailed = 1;
+        }
+    }
+
+    if (fd >= 0) close(fd);
+
+    if (!combineFailed) {
+        stampFile(combineOut, &newState.output);
+        if (!saveState(&newState)) {
+            printf("Unable to save combine state\n");
+        }
+    }
+    freeState(&newState);
+}
+
+static bool feedFlac(FLAC__StreamEncoder *enc, const int16_t *samples, uint32_t frames, FLAC__int32 *buffer) {
+    while (frames > 0) {
+        uint32_t n = frames > FLAC_BLOCK_FRAMES ? FLAC_BLOCK_FRAMES : frames;
+        const int16_t *src = samples;
+        if (combineGainTenths != 0) {
+            s16Scale(samples, flacScaled, n * 2, combineGain);
+            src = flacScaled;
+        }
+        for (uint32_t i = 0; i < n * 2; i++) {
+            buffer[i] = src[i];
+        }
+        if (!FLAC__stream_encoder_process_interleaved(enc, buffer, n)) return false;
+        samples += n * 2;
+        frames -= n;
+    }
+    return true;
+}
+
+static bool feedFlacNoise(FLAC__StreamEncoder *enc, CombinePiece *p, FLAC__int32 *buffer) {
+    static const int16_t silence[FLAC_BLOCK_FRAMES * 2] = { 0 };
+    uint32_t avail = roomNoise.samples ? roomNoise.frames : 0;
+    uint32_t from = p->noiseStart;
+    uint32_t done = 0;
+
+    while (done < p->frames) {
+        uint32_t n = p->frames - done;
+        if (avail == 0) {
+            if (n > FLAC_BLOCK_FRAMES) n = FLAC_BLOCK_FRAMES;
+            if (!feedFlac(enc, silence, n, buffer)) return false;
+        } else {
+            if (n > avail - from) n = avail - from;
+            if (!feedFlac(enc, &roomNoise.samples[from * 2], n, buffer)) return false;
+            from = 0;
+        }
+        done += n;
+    }
+    return true;
+}
+
+// Encode the whole sequence to FLAC.  A FLAC stream can't be extended in
+// place like the WAV can, so this is always a full pass, and the encoder
+// has to see the pieces in order; newer libFLACs spread the frames
+// across threads themselves.  It's encoded under another name and only
+// renamed over the last export once it's all there.
+static void combineFlac() {
+    char temp[1100];
+    uint64_t total = 0;
+    bool created = false;
+
+    snprintf(temp, sizeof(temp), "%s.tmp", combineOut);
+
+    FLAC__int32 *buffer = (FLAC__int32 *)malloc(FLAC_BLOCK_FRAMES * 2 * sizeof(FLAC__int32));
+    FLAC__StreamEncoder *enc = FLAC__stream_encoder_new();
+    if (!buffer || !enc || !layoutSession(1, 0, &total)) {
+        printf("Out of memory\n");
+        combineFailed = 1;
+    }
+
+    if (!combineFailed) {
+        FLAC__stream_encoder_set_channels(enc, 2);
+        FLAC__stream_encoder_set_bits_per_sample(enc, 16);
+        FLAC__stream_encoder_set_sample_rate(enc, combineRate);
+        FLAC__stream_encoder_set_compression_level(enc, FLAC_COMPRESSION);
+        FLAC__stream_encoder_set_total_samples_estimate(enc, total / 4);
+#if FLAC_API_VERSION_CURRENT >= 14
+        int threads = SDL_GetCPUCount();
+        if (threads > COMBINE_MAX_THREADS) threads = COMBINE_MAX_THREADS;
+        FLAC__stream_encoder_set_num_threads(enc, threads);
+#endif
+
+        FLAC__StreamEncoderInitStatus status = FLAC__stream_encoder_init_file(enc, temp, NULL, NULL);
+        if (status != FLAC__STREAM_ENCODER_INIT_STATUS_OK) {
+            printf("Unable to create %s: %s\n", temp, FLAC__StreamEncoderInitStatusString[status]);
+            combineFailed = 1;
+        } else {
+            created = true;
+        }
+    }
+
+    for (int i = 0; !combineFailed && (i < pieceCount); i++) {
+        CombinePiece *p = &pieces[i];
+        bool ok;
+
+        if (p->kind == PIECE_NOISE) {
+            ok = feedFlacNoise(enc, p, buffer);
+        } else {
+            struct WavView view;
+            ok = openSegment(&view, p->segment, p->frames);
+            if (ok) {
+                ok = feedFlac(enc, view.samples, p->frames, buffer);
+                wavClose(&view);
+            }
+        }
+
+        if (!ok) {
+            printf("Error encoding %s: %s\n", combineOut,
+                FLAC__StreamEncoderStateString[FLAC__stream_encoder_get_state(enc)]);
+            combineFailed = 1;
+        }
+    }
+
+    if (enc) {
+        // Flushes the last frames and fixes up the stream info
+        if (!FLAC__stream_encoder_finish(enc) && !combineFailed) {
+            printf("Error finishing %s\n", combineOut);
+            combineFailed = 1;
+        }
+        FLAC__stream_encoder_delete(enc);
+    }
+    free(buffer);
+
+    if (!combineFailed && (rename(temp, combineOut) < 0)) {
+        printf("Unable to replace %s: %s\n", combineOut, strerror(errno));
+        combineFailed = 1;
+    }
+    if (combineFailed && created) {
+        unlink(temp);
+    }
+}
+
+struct MeasureWorker {
+    LoudnessMeter meter;
+    LoudnessStats one;
+    LoudnessStats total;
+};
+
+// Use the measurements from last time if the audio hasn't changed since
+static bool loadMeasurement(MeasureWorker *w, const char *path, const char *cache, uint32_t frames) {
+    FileStamp audio, saved;
+    stampFile(path, &audio);
+    stampFile(cache, &saved);
+    if ((saved.size < 0) || olderStamp(&saved, &audio)) return false;
+    return loudnessLoad(&w->one, cache, combineRate, frames);
+}
+
+static void takeMeasurement(MeasureWorker *w, const int16_t *samples, uint32_t frames, const char *cache) {
+    loudnessReset(&w->meter);
+    loudnessAdd(&w->meter, samples, frames);
+    loudnessFinish(&w->meter);
+    memcpy(&w->one, &w->meter.stats, sizeof(LoudnessStats));
+    if (!loudnessSave(&w->one, cache, combineRate, frames)) {
+        printf("Unable to save %s\n", cache);
+    }
+}
+
+static bool measureSegment(MeasureWorker *w, int segment) {
+    char path[1100];
+    char cache[1100];
+    uint32_t frames = combineFrames[segment];
+
+    segmentPath(path, segment);
+    sprintf(cache, "%s/segment-%04d.ld", combineDir, segment);
+    if (loadMeasurement(w, path, cache, frames)) return true;
+
+    struct WavView view;
+    if (!openSegment(&view, segment, frames)) return false;
+    takeMeasurement(w, view.samples, frames, cache);
+    wavClose(&view);
+    return true;
+}
+
+static int measureWorker(void *arg) {
+    MeasureWorker *w = (MeasureWorker *)arg;
+
+    while (1) {
+        int i = __atomic_fetch_add(&nextMeasure, 1, __ATOMIC_RELAXED) + 1;
+        if (i > combineSegments) break;
+        if (combineFrames[i] == 0) continue;
+
+        if (measureSegment(w, i)) {
+            loudnessMerge(&w->total, &w->one, 1);
+        } else {
+            __atomic_store_n(&combineFailed, 1, __ATOMIC_RELAXED);
+        }
+    }
+    return 0;
+}
+
+// Measure the session as it will come out, room noise included, and set
+// the gain that brings it to the target without the true peak going over
+// the ceiling.  The gain goes in 0.1dB steps, so a few more segments
+// don't usually change it and the WAV can still be appended to.
+static bool measureSession() {
+    char path[1100];
+    char cache[1100];
+    MeasureWorker *workers[COMBINE_MAX_THREADS];
+    int threads = poolSize(combineSegments);
+    bool ok = true;
+
+    for (int i = 0; i < threads; i++) {
+        workers[i] = (MeasureWorker *)malloc(sizeof(MeasureWorker));
+        if (!workers[i] || !loudnessInit(&workers[i]->meter, combineRate)) {
+            threads = i + (workers[i] != NULL);
+            ok = false;
+            break;
+        }
+        loudnessClear(&workers[i]->total);
+    }
+
+    if (!ok) {
+        printf("Unable to measure loudness\n");
+    } else {
+        nextMeasure = 0;
+        runPool(measureWorker, (void **)workers, threads);
+        ok = !combineFailed;
+    }
+
+    if (ok) {
+        MeasureWorker *w = workers[0];
+        for (int i = 1; i < threads; i++) {
+            loudnessMerge(&w->total, &workers[i]->total, 1);
+        }
+
+        // Each gap is a random stretch of the room noise, so it's counted
+        // as however many times over the whole recording fits in them.
+        if (roomNoise.samples && (roomNoise.frames > 0)) {
+            sprintf(path, "%s/room-noise.wav", combineDir);
+            sprintf(cache, "%s/room-noise.ld", combineDir);
+            if (!loadMeasurement(w, path, cache, roomNoise.frames)) {
+                takeMeasurement(w, roomNoise.samples, roomNoise.frames, cache);
+            }
+            double gaps = (double)combineRate * (COMBINE_LEAD_IN_SECONDS + COMBINE_GAP_SECONDS * combineSegments);
+            loudnessMerge(&w->total, &w->one, gaps / roomNoise.frames);
+        }
+
+        double lufs = loudnessIntegrated(&w->total);
+        double peak = 20 * log10(w->total.truePeak > 0 ? w->total.truePeak : 1e-10);
+        if (lufs == -HUGE_VAL) {
+            printf("Session is too quiet to measure\n");
+        } else {
+            int tenths = (int)lrint((combineLoudness - lufs) * 10);
+            if (peak + tenths / 10.0 > COMBINE_PEAK_CEILING) {
+                tenths = (int)floor((COMBINE_PEAK_CEILING - peak) * 10);
+            }
+            printf("Loudness %.1f LUFS, true peak %.1f dBTP, gain %+.1f dB\n", lufs, peak, tenths / 10.0);
+            combineGainTenths = tenths;
+            combineGain = pow(10.0, tenths / 200.0);
+        }
+    }
+
+    for (int i = 0; i < threads; i++) {
+        free(workers[i]);
+    }
+    return ok;
+}
+
+static int combineMain(void *arg) {
+    uint64_t start = SDL_GetPerformanceCounter();
+    char path[1100];
+
+    // Without usable room noise the gaps are left silent
+    sprintf(path, "%s/room-noise.wav", combineDir);
+    if (wavOpen(&roomNoise, path) && ((roomNoise.channels != 2) || (roomNoise.rate != combineRate))) {
+        printf("%s: doesn't match the session format\n", path);
+        wavClose(&roomNoise);
+    }
+
+    if ((combineLoudness != 0) && !measureSession()) {
+        combineFailed = 1;
+    }
+
+    if (combineFailed) {
+        // Leave whatever's there alone
+    } else if (combineFormat == COMBINE_FLAC) {
+        combineFlac();
+    } else {
+        combineWav();
+    }
+
+    wavClose(&roomNoise);
+    free(pieces);
+    pieces = NULL;
+    pieceCount = 0;
+    free(combineFrames);
+    combineFrames = NULL;
+
+    statsTime(TIMER_COMBINE, start);
+    pushUserEvent(EVENT_COMBINED, !combineFailed);
+    __atomic_store_n(&combineActive, 0, __ATOMIC_RELEASE);
+    return 0;
+}
+
+bool startCombine(const char *sessionDir, const char *outPath, Manifest *manifest, int rate, int format, double loudness) {
+    if (combineBusy()) return false;
+
+    // The last run's thread has finished but still needs reaping
+    if (combineThread) {
+        SDL_WaitThread(combineThread, NULL);
+        combineThread = NULL;
+    }
+
+    snprintf(combineDir, sizeof(combineDir), "%s", sessionDir);
+    snprintf(combineOut, sizeof(combineOut), "%s", outPath);
+    combineRate = rate;
+    combineFormat = format;
+    combineLoudness = loudness;
+    combineGainTenths = 0;
+    combineGain = 1.0f;
+    combineFailed = 0;
+
+    // Take a copy, since the manifest will carry on changing meanwhile
+    combineSegments = manifest->count;
+    combineFrames = (uint32_t *)calloc(combineSegments + 1, sizeof(uint32_t));
+    if (!combineFrames) return false;
+    for (int i = 1; i <= combineSegments; i++) {
+        combineFrames[i] = manifestSegment(manifest, i)->frames;
+    }
+
+    __atomic_store_n(&combineActive, 1, __ATOMIC_RELEASE);
+    combineThread = SDL_CreateThread(combineMain, "combine", NULL);
+    if (!combineThread) {
+        printf("Unable to start combine thread: %s\n", SDL_GetError());
+        __atomic_store_n(&combineActive, 0, __ATOMIC_RELEASE);
+        return false;
+    }
+    return true;
+}
+
+bool combineBusy() {
+    return __atomic_load_n(&combineActive, __ATOMIC_ACQUIRE) != 0;
+}
+
+void waitForCombine() {
+    if (!combineThread) return;
+    SDL_WaitThread(combineThread, NULL);
+    combineThread = NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef _COMBINE_H
+#define _COMBINE_H
+
+// Assembles a session's segments into one WAV or FLAC file in the
+// background.
+//
+// The output is room noise, then each segment followed by a shorter gap
+// of room noise.  Its whole layout is worked out from the session
+// manifest first.  For WAV, a pool of threads then fills it in with
+// positional writes and the header goes on last.  EVENT_COMBINED is
+// posted when it's done, with 1 for success or 0 for failure.
+//
+// combine.state in the session directory records what went into the last
+// output.  If none of that has changed, only the segments recorded since
+// are appended; otherwise the whole file is rebuilt.  FLAC output is
+// always encoded from the start, on this thread, since the encoder needs
+// the pieces in order.
+//
+// Given a loudness target in LUFS, the session is measured first and
+// written out with whatever gain brings it there, short of pushing the
+// true peak past COMBINE_PEAK_CEILING.  Each segment's measurements are
+// kept next to it in a .ld file, so only new ones are read for that.  A
+// target of 0 leaves the levels as recorded.
+
+#define COMBINE_LEAD_IN_SECONDS 2
+#define COMBINE_GAP_SECONDS     1
+#define COMBINE_MAX_THREADS     8
+#define COMBINE_PEAK_CEILING    -1.0    // dBTP
+
+// Output formats
+#define COMBINE_WAV     0
+#define COMBINE_FLAC    1
+
+struct Manifest;
+
+bool startCombine(const char *sessionDir, const char *outPath, Manifest *manifest, int rate, int format, double loudness);
+bool combineBusy();
+void waitForCombine();
+
+#endif
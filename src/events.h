@@ -0,0 +1,25 @@
+#ifndef _EVENTS_H
+#define _EVENTS_H
+
+#include <SDL2/SDL.h>
+
+// Background threads tell the main loop about things by pushing an
+// SDL_USEREVENT with one of these codes.
+
+#define EVENT_TRANSCRIPT    1   // a segment's transcript has been written
+#define EVENT_PARTIAL       2   // a new partial hypothesis is available
+#define EVENT_COMBINED      3   // a combine has finished; value is success
+#define EVENT_AUDIO         4   // captured audio is waiting in the ring
+#define EVENT_SEGMENT       5   // a segment file is complete; value is its id
+#define EVENT_SEGMENT_FAILED 6  // a segment file couldn't be written
+
+static inline void pushUserEvent(int code, int value) {
+    SDL_Event e;
+    SDL_memset(&e, 0, sizeof(e));
+    e.type = SDL_USEREVENT;
+    e.user.code = code;
+    e.user.data1 = (void *)(intptr_t)value;
+    SDL_PushEvent(&e);
+}
+
+#endif
@@ -0,0 +1,107 @@
+/** @file filecopy.cpp
+ *
+ * @brief Kernel-side copying between files.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include "filecopy.h"
+
+#define COPY_CHUNK (1 << 30)
+
+// Once a method turns out not to work here it isn't tried again.  Any
+// thread may find that out, hence the atomics.
+static int haveCopyFileRange = 1;
+static int haveSendfile = 1;
+
+static bool unsupported(int err) {
+    return (err == ENOSYS) || (err == EXDEV) || (err == EINVAL) ||
+        (err == EOPNOTSUPP) || (err == EBADF);
+}
+
+static uint64_t copyWithRange(int out, off_t outPos, int in, off_t inPos, uint64_t len) {
+#ifdef __NR_copy_file_range
+    uint64_t done = 0;
+    loff_t pos = inPos;
+    loff_t opos = outPos;
+    while (done < len) {
+        size_t n = len - done > COPY_CHUNK ? COPY_CHUNK : len - done;
+        ssize_t r = syscall(__NR_copy_file_range, in, &pos, out, &opos, n, 0);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if ((done == 0) && unsupported(errno)) {
+                __atomic_store_n(&haveCopyFileRange, 0, __ATOMIC_RELAXED);
+            }
+            break;
+        }
+        if (r == 0) break;
+        done += r;
+    }
+    return done;
+#else
+    __atomic_store_n(&haveCopyFileRange, 0, __ATOMIC_RELAXED);
+    return 0;
+#endif
+}
+
+static uint64_t copyWithSendfile(int out, off_t outPos, int in, off_t inPos, uint64_t len) {
+    uint64_t done = 0;
+    off_t pos = inPos;
+    if (lseek(out, outPos, SEEK_SET) < 0) return 0;
+    while (done < len) {
+        size_t n = len - done > COPY_CHUNK ? COPY_CHUNK : len - done;
+        ssize_t r = sendfile(out, in, &pos, n);
+        if (r < 0) {
+            if (errno == EINTR) continue;
+            if ((done == 0) && unsupported(errno)) {
+                __atomic_store_n(&haveSendfile, 0, __ATOMIC_RELAXED);
+            }
+            break;
+        }
+        if (r == 0) break;
+        done += r;
+    }
+    return done;
+}
+
+static uint64_t copyWithBuffer(int out, off_t outPos, int in, off_t inPos, uint64_t len) {
+    char block[65536];
+    uint64_t done = 0;
+    while (done < len) {
+        size_t n = len - done > sizeof(block) ? sizeof(block) : len - done;
+        ssize_t r = pread(in, block, n, inPos + done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+
+        ssize_t w = 0;
+        while (w < r) {
+            ssize_t x = pwrite(out, block + w, r - w, outPos + done + w);
+            if (x < 0) {
+                if (errno == EINTR) continue;
+                return done + w;
+            }
+            w += x;
+        }
+        done += r;
+    }
+    return done;
+}
+
+uint64_t copyFileData(int out, off_t outPos, int in, off_t inPos, uint64_t len) {
+    uint64_t done = 0;
+
+    // Each method picks up wherever the one before it gave up
+    if (__atomic_load_n(&haveCopyFileRange, __ATOMIC_RELAXED)) {
+        done += copyWithRange(out, outPos, in, inPos, len);
+    }
+    if ((done < len) && __atomic_load_n(&haveSendfile, __ATOMIC_RELAXED)) {
+        done += copyWithSendfile(out, outPos + done, in, inPos + done, len - done);
+    }
+    if (done < len) {
+        done += copyWithBuffer(out, outPos + done, in, inPos + done, len - done);
+    }
+    return done;
+}
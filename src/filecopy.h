@@ -0,0 +1,17 @@
+#ifndef _FILECOPY_H
+#define _FILECOPY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Copy len bytes from inPos in one file to outPos in another without
+// bringing them into user space, if the kernel can manage it.  Tries
+// copy_file_range(), then sendfile(), then plain pread / pwrite.
+// Returns the number of bytes copied.
+//
+// The sendfile() fallback has to seek out, so threads copying into the
+// same file should each open their own descriptor for it.
+
+uint64_t copyFileData(int out, off_t outPos, int in, off_t inPos, uint64_t len);
+
+#endif
@@ -0,0 +1,261 @@
+/** @file kernels-neon.cpp
+ *
+ * @brief NEON versions of the sample scanning kernels.  On armv7l this
+ * file is built with -mfpu=neon and only called once the dispatcher in
+ * kernels.cpp has seen NEON in the hwcaps.
+ */
+
+#include "kernels.h"
+
+#if defined(__arm__) || defined(__aarch64__)
+
+#include <arm_neon.h>
+
+#define STATS_BATCH 8192
+
+static inline int hmax16(int16x8_t v) {
+    int16x4_t r = vpmax_s16(vget_low_s16(v), vget_high_s16(v));
+    r = vpmax_s16(r, r);
+    r = vpmax_s16(r, r);
+    return vget_lane_s16(r, 0);
+}
+
+static inline int hmin16(int16x8_t v) {
+    int16x4_t r = vpmin_s16(vget_low_s16(v), vget_high_s16(v));
+    r = vpmin_s16(r, r);
+    r = vpmin_s16(r, r);
+    return vget_lane_s16(r, 0);
+}
+
+static inline int64_t hsum32(int32x4_t v) {
+    int64x2_t w = vpaddlq_s32(v);
+    return vgetq_lane_s64(w, 0) + vgetq_lane_s64(w, 1);
+}
+
+static inline uint64_t hsumu16(uint16x8_t v) {
+    uint64x2_t w = vpaddlq_u32(vpaddlq_u16(v));
+    return vgetq_lane_u64(w, 0) + vgetq_lane_u64(w, 1);
+}
+
+// Mask of the lanes whose absolute value is above the threshold.  The
+// threshold is known to fit in 0..32767 here, so -t can't overflow.
+static inline uint16x8_t aboveMask(int16x8_t x, int16x8_t hi, int16x8_t lo) {
+    return vorrq_u16(vcgtq_s16(x, hi), vcltq_s16(x, lo));
+}
+
+static inline bool anySet(uint16x8_t m) {
+    uint32x2_t r = vorr_u32(vget_low_u32(vreinterpretq_u32_u16(m)),
+        vget_high_u32(vreinterpretq_u32_u16(m)));
+    return (vget_lane_u32(r, 0) | vget_lane_u32(r, 1)) != 0;
+}
+
+int s16AbsMaxNeon(const int16_t *samples, size_t count) {
+    int16x8_t vmax = vdupq_n_s16(0);
+    int16x8_t vmin = vdupq_n_s16(0);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t x = vld1q_s16(&samples[i]);
+        vmax = vmaxq_s16(vmax, x);
+        vmin = vminq_s16(vmin, x);
+    }
+
+    int mx = hmax16(vmax);
+    int mn = hmin16(vmin);
+    for (; i < count; i++) {
+        if (samples[i] > mx) mx = samples[i];
+        if (samples[i] < mn) mn = samples[i];
+    }
+    return mx > -mn ? mx : -mn;
+}
+
+void s16StatsNeon(const int16_t *samples, size_t count, PeakStats *stats) {
+    const int16x8_t zero = vdupq_n_s16(0);
+    int16x8_t vmax = zero;
+    int16x8_t vmin = zero;
+    int64_t up = 0, down = 0;
+    uint32_t upn = 0, downn = 0;
+    size_t i = 0;
+
+    while (i + 8 <= count) {
+        int32x4_t vup = vdupq_n_s32(0);
+        int32x4_t vdown = vdupq_n_s32(0);
+        uint16x8_t nup = vdupq_n_u16(0);
+        uint16x8_t ndown = vdupq_n_u16(0);
+        size_t end = i + STATS_BATCH * 8;
+        if (end > count) end = count;
+
+        for (; i + 8 <= end; i += 8) {
+            int16x8_t x = vld1q_s16(&samples[i]);
+            vmax = vmaxq_s16(vmax, x);
+            vmin = vminq_s16(vmin, x);
+
+            int16x8_t pos = vmaxq_s16(x, zero);
+            int16x8_t neg = vminq_s16(x, zero);
+            vup = vpadalq_s16(vup, pos);
+            vdown = vpadalq_s16(vdown, neg);
+            nup = vsubq_u16(nup, vcgtq_s16(x, zero));
+            ndown = vsubq_u16(ndown, vcltq_s16(x, zero));
+        }
+
+        up += hsum32(vup);
+        down += hsum32(vdown);
+        upn += hsumu16(nup);
+        downn += hsumu16(ndown);
+    }
+
+    PeakStats tail;
+    s16StatsScalar(&samples[i], count - i, &tail);
+
+    int mx = hmax16(vmax);
+    int mn = hmin16(vmin);
+    stats->max = tail.max > mx ? tail.max : mx;
+    stats->min = tail.min < mn ? tail.min : mn;
+    stats->upSum = up + tail.upSum;
+    stats->upCount = upn + tail.upCount;
+    stats->downSum = down + tail.downSum;
+    stats->downCount = downn + tail.downCount;
+}
+
+ptrdiff_t s16FirstAboveNeon(const int16_t *samples, size_t count, int threshold) {
+    if (threshold >= 32768) return -1;
+    if (threshold < 0) return count > 0 ? 0 : -1;
+
+    const int16x8_t hi = vdupq_n_s16(threshold);
+    const int16x8_t lo = vdupq_n_s16(-threshold);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        if (anySet(aboveMask(vld1q_s16(&samples[i]), hi, lo))) {
+            return i + s16FirstAboveScalar(&samples[i], 8, threshold);
+        }
+    }
+
+    ptrdiff_t r = s16FirstAboveScalar(&samples[i], count - i, threshold);
+    return r < 0 ? -1 : (ptrdiff_t)i + r;
+}
+
+ptrdiff_t s16LastAboveNeon(const int16_t *samples, size_t count, int threshold) {
+    if (threshold >= 32768) return -1;
+    if (threshold < 0) return (ptrdiff_t)count - 1;
+
+    const int16x8_t hi = vdupq_n_s16(threshold);
+    const int16x8_t lo = vdupq_n_s16(-threshold);
+    size_t i = count - (count % 8);
+
+    ptrdiff_t r = s16LastAboveScalar(&samples[i], count - i, threshold);
+    if (r >= 0) return i + r;
+
+    while (i > 0) {
+        i -= 8;
+        if (anySet(aboveMask(vld1q_s16(&samples[i]), hi, lo))) {
+            return i + s16LastAboveScalar(&samples[i], 8, threshold);
+        }
+    }
+    return -1;
+}
+
+uint64_t s16SumSquaresNeon(const int16_t *samples, size_t count) {
+    const int16x8_t floor = vdupq_n_s16(-32767);
+    uint64x2_t acc = vdupq_n_u64(0);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t x = vmaxq_s16(vld1q_s16(&samples[i]), floor);
+        int32x4_t lo = vmull_s16(vget_low_s16(x), vget_low_s16(x));
+        int32x4_t hi = vmull_s16(vget_high_s16(x), vget_high_s16(x));
+        acc = vpadalq_u32(acc, vreinterpretq_u32_s32(lo));
+        acc = vpadalq_u32(acc, vreinterpretq_u32_s32(hi));
+    }
+
+    return vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1) + s16SumSquaresScalar(&samples[i], count - i);
+}
+
+float f32DotNeon(const float *a, const float *b, size_t count) {
+    float32x4_t acc0 = vdupq_n_f32(0);
+    float32x4_t acc1 = vdupq_n_f32(0);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        acc0 = vmlaq_f32(acc0, vld1q_f32(&a[i]), vld1q_f32(&b[i]));
+        acc1 = vmlaq_f32(acc1, vld1q_f32(&a[i + 4]), vld1q_f32(&b[i + 4]));
+    }
+
+    float32x4_t acc = vaddq_f32(acc0, acc1);
+    float32x2_t r = vadd_f32(vget_low_f32(acc), vget_high_f32(acc));
+    return vget_lane_f32(vpadd_f32(r, r), 0) + f32DotScalar(&a[i], &b[i], count - i);
+}
+
+static inline int16x4_t scale4(int16x4_t x, float gain) {
+    const uint32x4_t sign = vdupq_n_u32(0x80000000);
+    const uint32x4_t half = vreinterpretq_u32_f32(vdupq_n_f32(0.5f));
+    float32x4_t v = vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(x)), gain);
+    float32x4_t r = vreinterpretq_f32_u32(vorrq_u32(vandq_u32(vreinterpretq_u32_f32(v), sign), half));
+    return vqmovn_s32(vcvtq_s32_f32(vaddq_f32(v, r)));
+}
+
+void s16ScaleNeon(const int16_t *in, int16_t *out, size_t count, float gain) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        int16x8_t x = vld1q_s16(&in[i]);
+        vst1q_s16(&out[i], vcombine_s16(scale4(vget_low_s16(x), gain), scale4(vget_high_s16(x), gain)));
+    }
+
+    s16ScaleScalar(&in[i], &out[i], count - i, gain);
+}
+
+// vld3 splits the packed bytes out into low, middle and high planes.
+void s24ToS16Neon(const uint8_t *in, int16_t *out, size_t count) {
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        uint8x16x3_t b = vld3q_u8(&in[i * 3]);
+        int16x8_t lo = vreinterpretq_s16_u8(vzipq_u8(b.val[1], b.val[2]).val[0]);
+        int16x8_t hi = vreinterpretq_s16_u8(vzipq_u8(b.val[1], b.val[2]).val[1]);
+        uint8x16_t round = vshrq_n_u8(b.val[0], 7);
+        lo = vqaddq_s16(lo, vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(round))));
+        hi = vqaddq_s16(hi, vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(round))));
+        vst1q_s16(&out[i], lo);
+        vst1q_s16(&out[i + 8], hi);
+    }
+
+    s24ToS16Scalar(&in[i * 3], &out[i], count - i);
+}
+
+void s32ToS16Neon(const int32_t *in, int16_t *out, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        int16x4_t lo = vqrshrn_n_s32(vld1q_s32(&in[i]), 16);
+        int16x4_t hi = vqrshrn_n_s32(vld1q_s32(&in[i + 4]), 16);
+        vst1q_s16(&out[i], vcombine_s16(lo, hi));
+    }
+
+    s32ToS16Scalar(&in[i], &out[i], count - i);
+}
+
+// vmax and vmin pass a NaN through, and it would convert to 0, so NaNs
+// are swapped for -32768 first as they are everywhere else.
+static inline int16x4_t floatToInt(float32x4_t v) {
+    const uint32x4_t sign = vdupq_n_u32(0x80000000);
+    const uint32x4_t half = vreinterpretq_u32_f32(vdupq_n_f32(0.5f));
+    const float32x4_t low = vdupq_n_f32(-32768.0f);
+    v = vmulq_n_f32(v, 32768.0f);
+    v = vbslq_f32(vceqq_f32(v, v), v, low);
+    v = vminq_f32(vmaxq_f32(v, low), vdupq_n_f32(32767.0f));
+    float32x4_t r = vreinterpretq_f32_u32(vorrq_u32(vandq_u32(vreinterpretq_u32_f32(v), sign), half));
+    return vqmovn_s32(vcvtq_s32_f32(vaddq_f32(v, r)));
+}
+
+void f32ToS16Neon(const float *in, int16_t *out, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        vst1q_s16(&out[i], vcombine_s16(floatToInt(vld1q_f32(&in[i])), floatToInt(vld1q_f32(&in[i + 4]))));
+    }
+
+    f32ToS16Scalar(&in[i], &out[i], count - i);
+}
+
+#endif
@@ -0,0 +1,686 @@
+/** @file kernels.cpp
+ *
+ * @brief Scalar, SSE2 and AVX2 versions of the sample scanning kernels
+ * and the run time dispatcher.  The NEON versions live in kernels-neon.cpp
+ * since they need building with -mfpu=neon on 32-bit ARM.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#define SSE2_TARGET __attribute__((target("sse2")))
+#endif
+
+#if defined(__arm__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+// Vector accumulators are flushed to 64 bits this often so they can't
+// overflow.
+#define STATS_BATCH 8192
+
+// ------------------------------------------------------------------ scalar
+
+int s16AbsMaxScalar(const int16_t *samples, size_t count) {
+    int peak = 0;
+    for (size_t i = 0; i < count; i++) {
+        int v = abs(samples[i]);
+        if (v > peak) peak = v;
+    }
+    return peak;
+}
+
+void s16StatsScalar(const int16_t *samples, size_t count, PeakStats *stats) {
+    int mn = 0, mx = 0;
+    int64_t up = 0, down = 0;
+    uint32_t upn = 0, downn = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        int v = samples[i];
+        if (v > mx) mx = v;
+        if (v < mn) mn = v;
+        if (v > 0) { up += v; upn++; }
+        if (v < 0) { down += v; downn++; }
+    }
+
+    stats->min = mn;
+    stats->max = mx;
+    stats->upSum = up;
+    stats->upCount = upn;
+    stats->downSum = down;
+    stats->downCount = downn;
+}
+
+ptrdiff_t s16FirstAboveScalar(const int16_t *samples, size_t count, int threshold) {
+    for (size_t i = 0; i < count; i++) {
+        if (abs(samples[i]) > threshold) return i;
+    }
+    return -1;
+}
+
+ptrdiff_t s16LastAboveScalar(const int16_t *samples, size_t count, int threshold) {
+    for (size_t i = count; i > 0; i--) {
+        if (abs(samples[i - 1]) > threshold) return i - 1;
+    }
+    return -1;
+}
+
+uint64_t s16SumSquaresScalar(const int16_t *samples, size_t count) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        int v = samples[i] < -32767 ? -32767 : samples[i];
+        sum += v * v;
+    }
+    return sum;
+}
+
+float f32DotScalar(const float *a, const float *b, size_t count) {
+    float sum = 0;
+    for (size_t i = 0; i < count; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+void s16ScaleScalar(const int16_t *in, int16_t *out, size_t count, float gain) {
+    for (size_t i = 0; i < count; i++) {
+        float v = in[i] * gain;
+        v = v < 0 ? v - 0.5f : v + 0.5f;
+        if (v > 32767) {
+            out[i] = 32767;
+        } else if (v < -32768) {
+            out[i] = -32768;
+        } else {
+            out[i] = (int16_t)v;
+        }
+    }
+}
+
+// Half way up is rounded up, which for 24 bits is the top bit of the low
+// byte.
+void s24ToS16Scalar(const uint8_t *in, int16_t *out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int v = (int16_t)((in[2] << 8) | in[1]) + (in[0] >> 7);
+        out[i] = v > 32767 ? 32767 : v;
+        in += 3;
+    }
+}
+
+void s32ToS16Scalar(const int32_t *in, int16_t *out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        int v = (in[i] >> 16) + ((in[i] >> 15) & 1);
+        out[i] = v > 32767 ? 32767 : v;
+    }
+}
+
+void f32ToS16Scalar(const float *in, int16_t *out, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        float v = in[i] * 32768.0f;
+        if (v > 32767) v = 32767;
+        if (!(v >= -32768)) v = -32768;
+        v = v < 0 ? v - 0.5f : v + 0.5f;
+        out[i] = (int16_t)v;
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+// -------------------------------------------------------------------- SSE2
+
+SSE2_TARGET
+static inline int hmax16(__m128i v) {
+    v = _mm_max_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_max_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    v = _mm_max_epi16(v, _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (int16_t)_mm_extract_epi16(v, 0);
+}
+
+SSE2_TARGET
+static inline int hmin16(__m128i v) {
+    v = _mm_min_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_min_epi16(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    v = _mm_min_epi16(v, _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (int16_t)_mm_extract_epi16(v, 0);
+}
+
+SSE2_TARGET
+static inline int64_t hsum32(__m128i v) {
+    int32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, v);
+    return (int64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+SSE2_TARGET
+static int s16AbsMaxSSE2(const int16_t *samples, size_t count) {
+    __m128i vmax = _mm_setzero_si128();
+    __m128i vmin = _mm_setzero_si128();
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)&samples[i]);
+        vmax = _mm_max_epi16(vmax, x);
+        vmin = _mm_min_epi16(vmin, x);
+    }
+
+    int mx = hmax16(vmax);
+    int mn = hmin16(vmin);
+    for (; i < count; i++) {
+        if (samples[i] > mx) mx = samples[i];
+        if (samples[i] < mn) mn = samples[i];
+    }
+    return mx > -mn ? mx : -mn;
+}
+
+SSE2_TARGET
+static void s16StatsSSE2(const int16_t *samples, size_t count, PeakStats *stats) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    __m128i vmax = zero;
+    __m128i vmin = zero;
+    int64_t up = 0, down = 0;
+    uint32_t upn = 0, downn = 0;
+    size_t i = 0;
+
+    while (i + 8 <= count) {
+        __m128i vup = zero, vdown = zero, nup = zero, ndown = zero;
+        size_t end = i + STATS_BATCH * 8;
+        if (end > count) end = count;
+
+        for (; i + 8 <= end; i += 8) {
+            __m128i x = _mm_loadu_si128((const __m128i *)&samples[i]);
+            vmax = _mm_max_epi16(vmax, x);
+            vmin = _mm_min_epi16(vmin, x);
+
+            __m128i pos = _mm_cmpgt_epi16(x, zero);
+            __m128i neg = _mm_cmplt_epi16(x, zero);
+            vup = _mm_add_epi32(vup, _mm_madd_epi16(_mm_and_si128(x, pos), ones));
+            vdown = _mm_add_epi32(vdown, _mm_madd_epi16(_mm_and_si128(x, neg), ones));
+            nup = _mm_sub_epi16(nup, pos);
+            ndown = _mm_sub_epi16(ndown, neg);
+        }
+
+        up += hsum32(vup);
+        down += hsum32(vdown);
+        upn += hsum32(_mm_madd_epi16(nup, ones));
+        downn += hsum32(_mm_madd_epi16(ndown, ones));
+    }
+
+    PeakStats tail;
+    s16StatsScalar(&samples[i], count - i, &tail);
+
+    int mx = hmax16(vmax);
+    int mn = hmin16(vmin);
+    stats->max = tail.max > mx ? tail.max : mx;
+    stats->min = tail.min < mn ? tail.min : mn;
+    stats->upSum = up + tail.upSum;
+    stats->upCount = upn + tail.upCount;
+    stats->downSum = down + tail.downSum;
+    stats->downCount = downn + tail.downCount;
+}
+
+SSE2_TARGET
+static ptrdiff_t s16FirstAboveSSE2(const int16_t *samples, size_t count, int threshold) {
+    if (threshold >= 32768) return -1;
+    if (threshold < 0) return count > 0 ? 0 : -1;
+
+    const __m128i hi = _mm_set1_epi16(threshold);
+    const __m128i lo = _mm_set1_epi16(-threshold);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)&samples[i]);
+        __m128i m = _mm_or_si128(_mm_cmpgt_epi16(x, hi), _mm_cmplt_epi16(x, lo));
+        int bits = _mm_movemask_epi8(m);
+        if (bits) return i + __builtin_ctz(bits) / 2;
+    }
+
+    ptrdiff_t r = s16FirstAboveScalar(&samples[i], count - i, threshold);
+    return r < 0 ? -1 : (ptrdiff_t)i + r;
+}
+
+SSE2_TARGET
+static ptrdiff_t s16LastAboveSSE2(const int16_t *samples, size_t count, int threshold) {
+    if (threshold >= 32768) return -1;
+    if (threshold < 0) return (ptrdiff_t)count - 1;
+
+    const __m128i hi = _mm_set1_epi16(threshold);
+    const __m128i lo = _mm_set1_epi16(-threshold);
+    size_t i = count - (count % 8);
+
+    ptrdiff_t r = s16LastAboveScalar(&samples[i], count - i, threshold);
+    if (r >= 0) return i + r;
+
+    while (i > 0) {
+        i -= 8;
+        __m128i x = _mm_loadu_si128((const __m128i *)&samples[i]);
+        __m128i m = _mm_or_si128(_mm_cmpgt_epi16(x, hi), _mm_cmplt_epi16(x, lo));
+        int bits = _mm_movemask_epi8(m);
+        if (bits) return i + (31 - __builtin_clz(bits)) / 2;
+    }
+    return -1;
+}
+
+// Each pair of squares fits in 31 bits once -32768 is clamped, so the
+// 32-bit sums from madd can be widened straight into 64-bit lanes.
+SSE2_TARGET
+static uint64_t s16SumSquaresSSE2(const int16_t *samples, size_t count) {
+    const __m128i floor = _mm_set1_epi16(-32767);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_max_epi16(_mm_loadu_si128((const __m128i *)&samples[i]), floor);
+        __m128i sq = _mm_madd_epi16(x, x);
+        acc = _mm_add_epi64(acc, _mm_unpacklo_epi32(sq, zero));
+        acc = _mm_add_epi64(acc, _mm_unpackhi_epi32(sq, zero));
+    }
+
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, acc);
+    return lanes[0] + lanes[1] + s16SumSquaresScalar(&samples[i], count - i);
+}
+
+SSE2_TARGET
+static float f32DotSSE2(const float *a, const float *b, size_t count) {
+    __m128 acc0 = _mm_setzero_ps();
+    __m128 acc1 = _mm_setzero_ps();
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(&a[i]), _mm_loadu_ps(&b[i])));
+        acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(&a[i + 4]), _mm_loadu_ps(&b[i + 4])));
+    }
+
+    float lanes[4];
+    _mm_storeu_ps(lanes, _mm_add_ps(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + f32DotScalar(&a[i], &b[i], count - i);
+}
+
+// Adding 0.5 with the sign of the product and then truncating rounds the
+// same way as the scalar version; packs does the saturation.
+SSE2_TARGET
+static void s16ScaleSSE2(const int16_t *in, int16_t *out, size_t count, float gain) {
+    const __m128 g = _mm_set1_ps(gain);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i x = _mm_loadu_si128((const __m128i *)&in[i]);
+        __m128 lo = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16)), g);
+        __m128 hi = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16)), g);
+        lo = _mm_add_ps(lo, _mm_or_ps(_mm_and_ps(lo, sign), half));
+        hi = _mm_add_ps(hi, _mm_or_ps(_mm_and_ps(hi, sign), half));
+        _mm_storeu_si128((__m128i *)&out[i], _mm_packs_epi32(_mm_cvttps_epi32(lo), _mm_cvttps_epi32(hi)));
+    }
+
+    s16ScaleScalar(&in[i], &out[i], count - i, gain);
+}
+
+// There's no byte shuffle in SSE2 to unpack 24-bit samples with, so
+// those are left to the scalar version below AVX2.
+SSE2_TARGET
+static void s32ToS16SSE2(const int32_t *in, int16_t *out, size_t count) {
+    const __m128i one = _mm_set1_epi32(1);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i *)&in[i]);
+        __m128i b = _mm_loadu_si128((const __m128i *)&in[i + 4]);
+        a = _mm_add_epi32(_mm_srai_epi32(a, 16), _mm_and_si128(_mm_srli_epi32(a, 15), one));
+        b = _mm_add_epi32(_mm_srai_epi32(b, 16), _mm_and_si128(_mm_srli_epi32(b, 15), one));
+        _mm_storeu_si128((__m128i *)&out[i], _mm_packs_epi32(a, b));
+    }
+
+    s32ToS16Scalar(&in[i], &out[i], count - i);
+}
+
+SSE2_TARGET
+static inline __m128i floatToInt(__m128 v) {
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 sign = _mm_set1_ps(-0.0f);
+    v = _mm_min_ps(_mm_max_ps(_mm_mul_ps(v, _mm_set1_ps(32768.0f)), _mm_set1_ps(-32768.0f)), _mm_set1_ps(32767.0f));
+    return _mm_cvttps_epi32(_mm_add_ps(v, _mm_or_ps(_mm_and_ps(v, sign), half)));
+}
+
+SSE2_TARGET
+static void f32ToS16SSE2(const float *in, int16_t *out, size_t count) {
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128i a = floatToInt(_mm_loadu_ps(&in[i]));
+        __m128i b = floatToInt(_mm_loadu_ps(&in[i + 4]));
+        _mm_storeu_si128((__m128i *)&out[i], _mm_packs_epi32(a, b));
+    }
+
+    f32ToS16Scalar(&in[i], &out[i], count - i);
+}
+
+// -------------------------------------------------------------------- AVX2
+
+__attribute__((target("avx2")))
+static inline __m128i fold16max(__m256i v) {
+    return _mm_max_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+static inline __m128i fold16min(__m256i v) {
+    return _mm_min_epi16(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+}
+
+__attribute__((target("avx2")))
+static inline int64_t hsum32x8(__m256i v) {
+    return hsum32(_mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+}
+
+__attribute__((target("avx2")))
+static int s16AbsMaxAVX2(const int16_t *samples, size_t count) {
+    __m256i vmax = _mm256_setzero_si256();
+    __m256i vmin = _mm256_setzero_si256();
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)&samples[i]);
+        vmax = _mm256_max_epi16(vmax, x);
+        vmin = _mm256_min_epi16(vmin, x);
+    }
+
+    int mx = hmax16(fold16max(vmax));
+    int mn = hmin16(fold16min(vmin));
+    for (; i < count; i++) {
+        if (samples[i] > mx) mx = samples[i];
+        if (samples[i] < mn) mn = samples[i];
+    }
+    return mx > -mn ? mx : -mn;
+}
+
+__attribute__((target("avx2")))
+static void s16StatsAVX2(const int16_t *samples, size_t count, PeakStats *stats) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    __m256i vmax = zero;
+    __m256i vmin = zero;
+    int64_t up = 0, down = 0;
+    uint32_t upn = 0, downn = 0;
+    size_t i = 0;
+
+    while (i + 16 <= count) {
+        __m256i vup = zero, vdown = zero, nup = zero, ndown = zero;
+        size_t end = i + STATS_BATCH * 16;
+        if (end > count) end = count;
+
+        for (; i + 16 <= end; i += 16) {
+            __m256i x = _mm256_loadu_si256((const __m256i *)&samples[i]);
+            vmax = _mm256_max_epi16(vmax, x);
+            vmin = _mm256_min_epi16(vmin, x);
+
+            __m256i pos = _mm256_cmpgt_epi16(x, zero);
+            __m256i neg = _mm256_cmpgt_epi16(zero, x);
+            vup = _mm256_add_epi32(vup, _mm256_madd_epi16(_mm256_and_si256(x, pos), ones));
+            vdown = _mm256_add_epi32(vdown, _mm256_madd_epi16(_mm256_and_si256(x, neg), ones));
+            nup = _mm256_sub_epi16(nup, pos);
+            ndown = _mm256_sub_epi16(ndown, neg);
+        }
+
+        up += hsum32x8(vup);
+        down += hsum32x8(vdown);
+        upn += hsum32x8(_mm256_madd_epi16(nup, ones));
+        downn += hsum32x8(_mm256_madd_epi16(ndown, ones));
+    }
+
+    PeakStats tail;
+    s16StatsScalar(&samples[i], count - i, &tail);
+
+    int mx = hmax16(fold16max(vmax));
+    int mn = hmin16(fold16min(vmin));
+    stats->max = tail.max > mx ? tail.max : mx;
+    stats->min = tail.min < mn ? tail.min : mn;
+    stats->upSum = up + tail.upSum;
+    stats->upCount = upn + tail.upCount;
+    stats->downSum = down + tail.downSum;
+    stats->downCount = downn + tail.downCount;
+}
+
+__attribute__((target("avx2")))
+static ptrdiff_t s16FirstAboveAVX2(const int16_t *samples, size_t count, int threshold) {
+    if (threshold >= 32768) return -1;
+    if (threshold < 0) return count > 0 ? 0 : -1;
+
+    const __m256i hi = _mm256_set1_epi16(threshold);
+    const __m256i lo = _mm256_set1_epi16(-threshold);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)&samples[i]);
+        __m256i m = _mm256_or_si256(_mm256_cmpgt_epi16(x, hi), _mm256_cmpgt_epi16(lo, x));
+        unsigned bits = _mm256_movemask_epi8(m);
+        if (bits) return i + __builtin_ctz(bits) / 2;
+    }
+
+    ptrdiff_t r = s16FirstAboveScalar(&samples[i], count - i, threshold);
+    return r < 0 ? -1 : (ptrdiff_t)i + r;
+}
+
+__attribute__((target("avx2")))
+static ptrdiff_t s16LastAboveAVX2(const int16_t *samples, size_t count, int threshold) {
+    if (threshold >= 32768) return -1;
+    if (threshold < 0) return (ptrdiff_t)count - 1;
+
+    const __m256i hi = _mm256_set1_epi16(threshold);
+    const __m256i lo = _mm256_set1_epi16(-threshold);
+    size_t i = count - (count % 16);
+
+    ptrdiff_t r = s16LastAboveScalar(&samples[i], count - i, threshold);
+    if (r >= 0) return i + r;
+
+    while (i > 0) {
+        i -= 16;
+        __m256i x = _mm256_loadu_si256((const __m256i *)&samples[i]);
+        __m256i m = _mm256_or_si256(_mm256_cmpgt_epi16(x, hi), _mm256_cmpgt_epi16(lo, x));
+        unsigned bits = _mm256_movemask_epi8(m);
+        if (bits) return i + (31 - __builtin_clz(bits)) / 2;
+    }
+    return -1;
+}
+
+__attribute__((target("avx2")))
+static uint64_t s16SumSquaresAVX2(const int16_t *samples, size_t count) {
+    const __m256i floor = _mm256_set1_epi16(-32767);
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i x = _mm256_max_epi16(_mm256_loadu_si256((const __m256i *)&samples[i]), floor);
+        __m256i sq = _mm256_madd_epi16(x, x);
+        acc = _mm256_add_epi64(acc, _mm256_unpacklo_epi32(sq, zero));
+        acc = _mm256_add_epi64(acc, _mm256_unpackhi_epi32(sq, zero));
+    }
+
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + s16SumSquaresScalar(&samples[i], count - i);
+}
+
+__attribute__((target("avx2")))
+static float f32DotAVX2(const float *a, const float *b, size_t count) {
+    __m256 acc0 = _mm256_setzero_ps();
+    __m256 acc1 = _mm256_setzero_ps();
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        acc0 = _mm256_add_ps(acc0, _mm256_mul_ps(_mm256_loadu_ps(&a[i]), _mm256_loadu_ps(&b[i])));
+        acc1 = _mm256_add_ps(acc1, _mm256_mul_ps(_mm256_loadu_ps(&a[i + 8]), _mm256_loadu_ps(&b[i + 8])));
+    }
+
+    __m256 acc = _mm256_add_ps(acc0, acc1);
+    __m128 v = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    float lanes[4];
+    _mm_storeu_ps(lanes, v);
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + f32DotScalar(&a[i], &b[i], count - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m128i scale8AVX2(const int16_t *in, __m256 g) {
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)in));
+    __m256 v = _mm256_mul_ps(_mm256_cvtepi32_ps(x), g);
+    v = _mm256_add_ps(v, _mm256_or_ps(_mm256_and_ps(v, sign), half));
+    __m256i r = _mm256_cvttps_epi32(v);
+    return _mm_packs_epi32(_mm256_castsi256_si128(r), _mm256_extracti128_si256(r, 1));
+}
+
+__attribute__((target("avx2")))
+static void s16ScaleAVX2(const int16_t *in, int16_t *out, size_t count, float gain) {
+    const __m256 g = _mm256_set1_ps(gain);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m128i lo = scale8AVX2(&in[i], g);
+        __m128i hi = scale8AVX2(&in[i + 8], g);
+        _mm_storeu_si128((__m128i *)&out[i], lo);
+        _mm_storeu_si128((__m128i *)&out[i + 8], hi);
+    }
+
+    s16ScaleScalar(&in[i], &out[i], count - i, gain);
+}
+
+// Four packed samples from each 12 bytes, shuffled up into the top of
+// 32-bit lanes.  Each load takes 16 bytes for 12, so the loop stops
+// short enough that the last one doesn't read past the end.
+__attribute__((target("avx2")))
+static void s24ToS16AVX2(const uint8_t *in, int16_t *out, size_t count) {
+    const __m256i spread = _mm256_setr_epi8(
+        -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+        -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+    const __m256i round = _mm256_set1_epi32(128);
+    size_t i = 0;
+
+    for (; i + 18 <= count; i += 16) {
+        const uint8_t *p = &in[i * 3];
+        __m256i a = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)p)),
+                                            _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+        __m256i b = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(p + 24))),
+                                            _mm_loadu_si128((const __m128i *)(p + 36)), 1);
+        a = _mm256_srai_epi32(_mm256_add_epi32(_mm256_srai_epi32(_mm256_shuffle_epi8(a, spread), 8), round), 8);
+        b = _mm256_srai_epi32(_mm256_add_epi32(_mm256_srai_epi32(_mm256_shuffle_epi8(b, spread), 8), round), 8);
+        __m256i r = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)&out[i], r);
+    }
+
+    s24ToS16Scalar(&in[i * 3], &out[i], count - i);
+}
+
+__attribute__((target("avx2")))
+static void s32ToS16AVX2(const int32_t *in, int16_t *out, size_t count) {
+    const __m256i one = _mm256_set1_epi32(1);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)&in[i]);
+        __m256i b = _mm256_loadu_si256((const __m256i *)&in[i + 8]);
+        a = _mm256_add_epi32(_mm256_srai_epi32(a, 16), _mm256_and_si256(_mm256_srli_epi32(a, 15), one));
+        b = _mm256_add_epi32(_mm256_srai_epi32(b, 16), _mm256_and_si256(_mm256_srli_epi32(b, 15), one));
+        __m256i r = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)&out[i], r);
+    }
+
+    s32ToS16Scalar(&in[i], &out[i], count - i);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i floatToInt8(__m256 v) {
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    v = _mm256_mul_ps(v, _mm256_set1_ps(32768.0f));
+    v = _mm256_min_ps(_mm256_max_ps(v, _mm256_set1_ps(-32768.0f)), _mm256_set1_ps(32767.0f));
+    return _mm256_cvttps_epi32(_mm256_add_ps(v, _mm256_or_ps(_mm256_and_ps(v, sign), half)));
+}
+
+__attribute__((target("avx2")))
+static void f32ToS16AVX2(const float *in, int16_t *out, size_t count) {
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256i a = floatToInt8(_mm256_loadu_ps(&in[i]));
+        __m256i b = floatToInt8(_mm256_loadu_ps(&in[i + 8]));
+        __m256i r = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8);
+        _mm256_storeu_si256((__m256i *)&out[i], r);
+    }
+
+    f32ToS16Scalar(&in[i], &out[i], count - i);
+}
+
+#endif
+
+// -------------------------------------------------------------- dispatcher
+
+int (*s16AbsMax)(const int16_t *samples, size_t count) = s16AbsMaxScalar;
+void (*s16Stats)(const int16_t *samples, size_t count, PeakStats *stats) = s16StatsScalar;
+ptrdiff_t (*s16FirstAbove)(const int16_t *samples, size_t count, int threshold) = s16FirstAboveScalar;
+ptrdiff_t (*s16LastAbove)(const int16_t *samples, size_t count, int threshold) = s16LastAboveScalar;
+uint64_t (*s16SumSquares)(const int16_t *samples, size_t count) = s16SumSquaresScalar;
+float (*f32Dot)(const float *a, const float *b, size_t count) = f32DotScalar;
+void (*s16Scale)(const int16_t *in, int16_t *out, size_t count, float gain) = s16ScaleScalar;
+void (*s24ToS16)(const uint8_t *in, int16_t *out, size_t count) = s24ToS16Scalar;
+void (*s32ToS16)(const int32_t *in, int16_t *out, size_t count) = s32ToS16Scalar;
+void (*f32ToS16)(const float *in, int16_t *out, size_t count) = f32ToS16Scalar;
+
+const char *kernelName = "scalar";
+
+void initKernels() {
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        s16AbsMax = s16AbsMaxAVX2;
+        s16Stats = s16StatsAVX2;
+        s16FirstAbove = s16FirstAboveAVX2;
+        s16LastAbove = s16LastAboveAVX2;
+        s16SumSquares = s16SumSquaresAVX2;
+        f32Dot = f32DotAVX2;
+        s16Scale = s16ScaleAVX2;
+        s24ToS16 = s24ToS16AVX2;
+        s32ToS16 = s32ToS16AVX2;
+        f32ToS16 = f32ToS16AVX2;
+        kernelName = "avx2";
+    } else if (__builtin_cpu_supports("sse2")) {
+        s16AbsMax = s16AbsMaxSSE2;
+        s16Stats = s16StatsSSE2;
+        s16FirstAbove = s16FirstAboveSSE2;
+        s16LastAbove = s16LastAboveSSE2;
+        s16SumSquares = s16SumSquaresSSE2;
+        f32Dot = f32DotSSE2;
+        s16Scale = s16ScaleSSE2;
+        s32ToS16 = s32ToS16SSE2;
+        f32ToS16 = f32ToS16SSE2;
+        kernelName = "sse2";
+    }
+#endif
+
+#if defined(__arm__) || defined(__aarch64__)
+    bool neon = true;
+#if defined(__arm__) && defined(__linux__)
+    neon = (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+    if (neon) {
+        s16AbsMax = s16AbsMaxNeon;
+        s16Stats = s16StatsNeon;
+        s16FirstAbove = s16FirstAboveNeon;
+        s16LastAbove = s16LastAboveNeon;
+        s16SumSquares = s16SumSquaresNeon;
+        f32Dot = f32DotNeon;
+        s16Scale = s16ScaleNeon;
+        s24ToS16 = s24ToS16Neon;
+        s32ToS16 = s32ToS16Neon;
+        f32ToS16 = f32ToS16Neon;
+        kernelName = "neon";
+    }
+#endif
+}
@@ -0,0 +1,78 @@
+#ifndef _KERNELS_H
+#define _KERNELS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Vectorised scans over interleaved S16 audio.  All counts are in
+// samples (not frames), so a stereo frame is two samples.  initKernels()
+// picks the best implementation the CPU supports at run time.
+
+struct PeakStats {
+    int min;
+    int max;
+    int64_t upSum;      // sum of the positive samples
+    uint32_t upCount;
+    int64_t downSum;    // sum of the negative samples
+    uint32_t downCount;
+};
+
+// Largest absolute sample value
+extern int (*s16AbsMax)(const int16_t *samples, size_t count);
+
+// Min, max and the positive / negative sums used to draw the waveform
+extern void (*s16Stats)(const int16_t *samples, size_t count, PeakStats *stats);
+
+// Index of the first / last sample whose absolute value is above the
+// threshold, or -1 if there isn't one.
+extern ptrdiff_t (*s16FirstAbove)(const int16_t *samples, size_t count, int threshold);
+extern ptrdiff_t (*s16LastAbove)(const int16_t *samples, size_t count, int threshold);
+
+// Sum of the squared samples, for RMS levels.  -32768 is counted as
+// -32767 so the vector versions can't overflow.
+extern uint64_t (*s16SumSquares)(const int16_t *samples, size_t count);
+
+// Dot product of two float vectors, for the FIR filters
+extern float (*f32Dot)(const float *a, const float *b, size_t count);
+
+// out = in * gain, rounded half away from zero and saturated.  in and
+// out may be the same buffer.
+extern void (*s16Scale)(const int16_t *in, int16_t *out, size_t count, float gain);
+
+// Conversions from the capture formats to S16, rounded to nearest and
+// saturated.  Packed 24-bit is three bytes a sample, little endian; float
+// is full scale at 1.0, and a NaN comes out as -32768.
+extern void (*s24ToS16)(const uint8_t *in, int16_t *out, size_t count);
+extern void (*s32ToS16)(const int32_t *in, int16_t *out, size_t count);
+extern void (*f32ToS16)(const float *in, int16_t *out, size_t count);
+
+extern const char *kernelName;
+
+void initKernels();
+
+// Implementations, for the dispatcher
+int s16AbsMaxScalar(const int16_t *samples, size_t count);
+void s16StatsScalar(const int16_t *samples, size_t count, PeakStats *stats);
+ptrdiff_t s16FirstAboveScalar(const int16_t *samples, size_t count, int threshold);
+ptrdiff_t s16LastAboveScalar(const int16_t *samples, size_t count, int threshold);
+uint64_t s16SumSquaresScalar(const int16_t *samples, size_t count);
+float f32DotScalar(const float *a, const float *b, size_t count);
+void s16ScaleScalar(const int16_t *in, int16_t *out, size_t count, float gain);
+void s24ToS16Scalar(const uint8_t *in, int16_t *out, size_t count);
+void s32ToS16Scalar(const int32_t *in, int16_t *out, size_t count);
+void f32ToS16Scalar(const float *in, int16_t *out, size_t count);
+
+#if defined(__arm__) || defined(__aarch64__)
+int s16AbsMaxNeon(const int16_t *samples, size_t count);
+void s16StatsNeon(const int16_t *samples, size_t count, PeakStats *stats);
+ptrdiff_t s16FirstAboveNeon(const int16_t *samples, size_t count, int threshold);
+ptrdiff_t s16LastAboveNeon(const int16_t *samples, size_t count, int threshold);
+uint64_t s16SumSquaresNeon(const int16_t *samples, size_t count);
+float f32DotNeon(const float *a, const float *b, size_t count);
+void s16ScaleNeon(const int16_t *in, int16_t *out, size_t count, float gain);
+void s24ToS16Neon(const uint8_t *in, int16_t *out, size_t count);
+void s32ToS16Neon(const int32_t *in, int16_t *out, size_t count);
+void f32ToS16Neon(const float *in, int16_t *out, size_t count);
+#endif
+
+#endif
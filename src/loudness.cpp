@@ -0,0 +1,300 @@
+/** @file loudness.cpp
+ *
+ * @brief BS.1770 loudness and true peak measurement.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include "kernels.h"
+#include "resample.h"
+#include "loudness.h"
+
+#define LOUDNESS_MAGIC 0x44554f4c   // "LOUD"
+
+struct LoudnessFileHeader {
+    uint32_t magic;
+    uint32_t rate;
+    uint32_t frames;
+    uint32_t bins;
+    double truePeak;
+};
+
+struct LoudnessFileBin {
+    uint32_t bin;
+    uint32_t count;
+    double energy;
+};
+
+bool loudnessInit(LoudnessMeter *m, int rate) {
+    memset(m, 0, sizeof(LoudnessMeter));
+    m->rate = rate;
+    m->stepFrames = rate / 10;
+    if (m->stepFrames == 0) return false;
+
+    // The K-weighting pair from BS.1770, worked out for any rate rather
+    // than the tabulated 48k coefficients: a high shelf for the head...
+    double f0 = 1681.974450955533;
+    double gain = 3.999843853973347;
+    double q = 0.7071752369554196;
+    double k = tan(M_PI * f0 / rate);
+    double vh = pow(10.0, gain / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    m->shelf[0] = (vh + vb * k / q + k * k) / a0;
+    m->shelf[1] = 2.0 * (k * k - vh) / a0;
+    m->shelf[2] = (vh - vb * k / q + k * k) / a0;
+    m->shelf[3] = 2.0 * (k * k - 1.0) / a0;
+    m->shelf[4] = (1.0 - k / q + k * k) / a0;
+
+    // ...and the RLB high-pass
+    f0 = 38.13547087602444;
+    q = 0.5003270373238773;
+    k = tan(M_PI * f0 / rate);
+    a0 = 1.0 + k / q + k * k;
+    m->highpass[0] = 1.0;
+    m->highpass[1] = -2.0;
+    m->highpass[2] = 1.0;
+    m->highpass[3] = 2.0 * (k * k - 1.0) / a0;
+    m->highpass[4] = (1.0 - k / q + k * k) / a0;
+
+    // Interpolation filter for the true peak, split into its phases and
+    // each stored reversed as the resampler does.  No phase can come out
+    // bigger than its input's peak times the sum of its taps' sizes.
+    double h[LOUDNESS_OVERSAMPLE * LOUDNESS_TP_TAPS];
+    designLowpass(h, LOUDNESS_OVERSAMPLE * LOUDNESS_TP_TAPS, 0.5 / LOUDNESS_OVERSAMPLE);
+    for (int p = 0; p < LOUDNESS_OVERSAMPLE; p++) {
+        double sum = 0;
+        for (int j = 0; j < LOUDNESS_TP_TAPS; j++) {
+            float c = h[p + j * LOUDNESS_OVERSAMPLE] * LOUDNESS_OVERSAMPLE;
+            m->coeffs[p * LOUDNESS_TP_TAPS + (LOUDNESS_TP_TAPS - 1 - j)] = c;
+            sum += fabs(c);
+        }
+        if (sum > m->tpGain) m->tpGain = sum;
+    }
+
+    loudnessReset(m);
+    return true;
+}
+
+void loudnessReset(LoudnessMeter *m) {
+    memset(m->state, 0, sizeof(m->state));
+    m->stepPos = 0;
+    m->stepEnergy = 0;
+    m->stepCount = 0;
+    memset(m->history, 0, sizeof(m->history));
+    m->lastPeak = 0;
+    loudnessClear(&m->stats);
+}
+
+void loudnessClear(LoudnessStats *s) {
+    memset(s, 0, sizeof(LoudnessStats));
+}
+
+static inline double blockLoudness(double meanSquare) {
+    return -0.691 + 10 * log10(meanSquare);
+}
+
+static void addBlock(LoudnessStats *s, double meanSquare) {
+    if (meanSquare <= 0) return;
+    double lufs = blockLoudness(meanSquare);
+    if (lufs < LOUDNESS_GATE) return;
+
+    int bin = (int)((lufs - LOUDNESS_GATE) / LOUDNESS_BIN_LU);
+    if (bin >= LOUDNESS_BINS) bin = LOUDNESS_BINS - 1;
+    s->count[bin] += 1;
+    s->energy[bin] += meanSquare;
+}
+
+// A 100ms step is done; the last four of them make a gating block.
+static void endStep(LoudnessMeter *m) {
+    m->steps[0] = m->steps[1];
+    m->steps[1] = m->steps[2];
+    m->steps[2] = m->steps[3];
+    m->steps[3] = m->stepEnergy;
+    m->stepEnergy = 0;
+    m->stepPos = 0;
+
+    if (m->stepCount < 4) m->stepCount++;
+    if (m->stepCount == 4) {
+        double sum = m->steps[0] + m->steps[1] + m->steps[2] + m->steps[3];
+        addBlock(&m->stats, sum / (4.0 * m->stepFrames));
+    }
+}
+
+static inline double biquad(const double *c, double *s, double x) {
+    double y = c[0] * x + s[0];
+    s[0] = c[1] * x - c[3] * y + s[1];
+    s[1] = c[2] * x - c[4] * y;
+    return y;
+}
+
+static void weigh(LoudnessMeter *m, const int16_t *samples, uint32_t frames) {
+    for (uint32_t i = 0; i < frames; i++) {
+        double e = 0;
+        for (int c = 0; c < 2; c++) {
+            double y = biquad(m->shelf, &m->state[c][0], samples[c] / 32768.0);
+            y = biquad(m->highpass, &m->state[c][2], y);
+            e += y * y;
+        }
+        samples += 2;
+
+        m->stepEnergy += e;
+        if (++m->stepPos == m->stepFrames) endStep(m);
+    }
+}
+
+// A block whose samples, times the most the filter can gain, still don't
+// reach the highest peak so far can't produce a new one, so the
+// interpolation is skipped for it.  The filter reaches back into the
+// frames before, so those count too.  After a block shorter than that
+// some of them are from further back still, which the old peak covers.
+static void findPeak(LoudnessMeter *m, const int16_t *samples, uint32_t frames) {
+    const uint32_t history = LOUDNESS_TP_TAPS - 1;
+    float peak = s16AbsMax(samples, frames * 2) / 32768.0f;
+    float reach = peak > m->lastPeak ? peak : m->lastPeak;
+    bool interpolate = reach * m->tpGain > m->stats.truePeak;
+    if (frames >= history) {
+        m->lastPeak = s16AbsMax(&samples[(frames - history) * 2], history * 2) / 32768.0f;
+    } else {
+        m->lastPeak = reach;
+    }
+    if (peak > m->stats.truePeak) m->stats.truePeak = peak;
+
+    for (int c = 0; c < 2; c++) {
+        float *buf = m->history[c];
+        for (uint32_t i = 0; i < frames; i++) {
+            buf[history + i] = samples[i * 2 + c] / 32768.0f;
+        }
+
+        if (interpolate) {
+            for (uint32_t i = 0; i < frames; i++) {
+                for (int p = 0; p < LOUDNESS_OVERSAMPLE; p++) {
+                    float v = fabsf(f32Dot(&m->coeffs[p * LOUDNESS_TP_TAPS], &buf[i], LOUDNESS_TP_TAPS));
+                    if (v > peak) peak = v;
+                }
+            }
+        }
+
+        memmove(buf, &buf[frames], history * sizeof(float));
+    }
+
+    if (peak > m->stats.truePeak) m->stats.truePeak = peak;
+}
+
+void loudnessAdd(LoudnessMeter *m, const int16_t *samples, uint32_t frames) {
+    while (frames > 0) {
+        uint32_t n = frames > LOUDNESS_TP_BLOCK ? LOUDNESS_TP_BLOCK : frames;
+        weigh(m, samples, n);
+        findPeak(m, samples, n);
+        samples += n * 2;
+        frames -= n;
+    }
+}
+
+// Run the interpolator out into silence, which catches any overshoot
+// from the last samples stopping short.  The loudness blocks don't see it.
+void loudnessFinish(LoudnessMeter *m) {
+    static const int16_t silence[(LOUDNESS_TP_TAPS - 1) * 2] = { 0 };
+    findPeak(m, silence, LOUDNESS_TP_TAPS - 1);
+}
+
+void loudnessMerge(LoudnessStats *into, const LoudnessStats *from, double weight) {
+    for (int i = 0; i < LOUDNESS_BINS; i++) {
+        into->count[i] += from->count[i] * weight;
+        into->energy[i] += from->energy[i] * weight;
+    }
+    if (from->truePeak > into->truePeak) into->truePeak = from->truePeak;
+}
+
+double loudnessIntegrated(const LoudnessStats *s) {
+    double count = 0, energy = 0;
+    for (int i = 0; i < LOUDNESS_BINS; i++) {
+        count += s->count[i];
+        energy += s->energy[i];
+    }
+    if (count <= 0) return -HUGE_VAL;
+
+    // Relative gate 10 LU under the absolute-gated loudness, taking the
+    // bins whose middle is above it
+    double gate = blockLoudness(energy / count) - 10;
+    int first = (int)ceil((gate - LOUDNESS_GATE) / LOUDNESS_BIN_LU - 0.5);
+    if (first < 0) first = 0;
+
+    count = 0;
+    energy = 0;
+    for (int i = first; i < LOUDNESS_BINS; i++) {
+        count += s->count[i];
+        energy += s->energy[i];
+    }
+    if (count <= 0) return -HUGE_VAL;
+    return blockLoudness(energy / count);
+}
+
+// Written under another name and renamed, so a combine that's cut short
+// can't leave half a file that looks newer than the audio.
+bool loudnessSave(const LoudnessStats *s, const char *path, int rate, uint32_t frames) {
+    char temp[1100];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return false;
+
+    struct LoudnessFileHeader header;
+    header.magic = LOUDNESS_MAGIC;
+    header.rate = rate;
+    header.frames = frames;
+    header.bins = 0;
+    header.truePeak = s->truePeak;
+    for (int i = 0; i < LOUDNESS_BINS; i++) {
+        if (s->count[i] > 0) header.bins++;
+    }
+
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header);
+    for (int i = 0; ok && (i < LOUDNESS_BINS); i++) {
+        if (s->count[i] <= 0) continue;
+        struct LoudnessFileBin bin;
+        bin.bin = i;
+        bin.count = (uint32_t)s->count[i];
+        bin.energy = s->energy[i];
+        ok = write(fd, &bin, sizeof(bin)) == sizeof(bin);
+    }
+    ok = (close(fd) == 0) && ok;
+    if (ok) ok = rename(temp, path) == 0;
+
+    if (!ok) unlink(temp);
+    return ok;
+}
+
+bool loudnessLoad(LoudnessStats *s, const char *path, int rate, uint32_t frames) {
+    loudnessClear(s);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct LoudnessFileHeader header;
+    bool ok = (read(fd, &header, sizeof(header)) == sizeof(header)) &&
+        (header.magic == LOUDNESS_MAGIC) &&
+        (header.rate == (uint32_t)rate) &&
+        (header.frames == frames) &&
+        (header.bins <= LOUDNESS_BINS);
+
+    for (uint32_t i = 0; ok && (i < header.bins); i++) {
+        struct LoudnessFileBin bin;
+        ok = (read(fd, &bin, sizeof(bin)) == sizeof(bin)) && (bin.bin < LOUDNESS_BINS);
+        if (ok) {
+            s->count[bin.bin] = bin.count;
+            s->energy[bin.bin] = bin.energy;
+        }
+    }
+    close(fd);
+
+    if (!ok) {
+        loudnessClear(s);
+        return false;
+    }
+    s->truePeak = header.truePeak;
+    return true;
+}
@@ -0,0 +1,75 @@
+#ifndef _LOUDNESS_H
+#define _LOUDNESS_H
+
+#include <stdint.h>
+
+// ITU-R BS.1770 (EBU R128) integrated loudness and true peak of
+// interleaved S16 stereo.
+//
+// The K-weighted signal is cut into 400ms gating blocks every 100ms, and
+// each block goes into a histogram in 0.1 LU steps above the -70 LUFS
+// absolute gate, along with its energy.  That's all the gated integral
+// needs, and histograms of separately measured pieces just add up, so a
+// segment only ever has to be measured once.  Applying the relative gate
+// a bin at a time rather than a block at a time moves the result by well
+// under 0.1 LU.  Blocks that would straddle the end of one piece and the
+// start of the next aren't seen, which for takes of more than a few
+// seconds is worth a fraction of a LU at most.
+//
+// True peak is found by oversampling four times, as in BS.1770 annex 2.
+
+#define LOUDNESS_BINS       800     // -70 to +10 LUFS
+#define LOUDNESS_BIN_LU     0.1
+#define LOUDNESS_GATE       -70.0
+#define LOUDNESS_OVERSAMPLE 4
+#define LOUDNESS_TP_TAPS    12      // per phase
+#define LOUDNESS_TP_BLOCK   1024    // frames
+
+struct LoudnessStats {
+    double count[LOUDNESS_BINS];    // gating blocks in each bin
+    double energy[LOUDNESS_BINS];   // sum of their mean squares
+    double truePeak;                // linear, 1.0 is full scale
+};
+
+struct LoudnessMeter {
+    int rate;
+    double shelf[5];                // K-weighting: b0 b1 b2 a1 a2
+    double highpass[5];
+    double state[2][4];             // per channel, both biquads
+    uint32_t stepFrames;            // 100ms
+    uint32_t stepPos;
+    double stepEnergy;
+    double steps[4];                // the last four 100ms sums
+    int stepCount;
+    float coeffs[LOUDNESS_OVERSAMPLE * LOUDNESS_TP_TAPS];
+    float history[2][LOUDNESS_TP_TAPS - 1 + LOUDNESS_TP_BLOCK];
+    float lastPeak;                 // sample peak of what's in history
+    float tpGain;                   // most the interpolator can add to it
+    LoudnessStats stats;
+};
+
+bool loudnessInit(LoudnessMeter *m, int rate);
+
+// Start measuring something new from silence, with empty stats
+void loudnessReset(LoudnessMeter *m);
+
+void loudnessAdd(LoudnessMeter *m, const int16_t *samples, uint32_t frames);
+
+// Call at the end, before taking the stats
+void loudnessFinish(LoudnessMeter *m);
+
+void loudnessClear(LoudnessStats *s);
+
+// Add weight times from's blocks into into
+void loudnessMerge(LoudnessStats *into, const LoudnessStats *from, double weight);
+
+// Gated integrated loudness in LUFS, or -HUGE_VAL if nothing was loud
+// enough to count.
+double loudnessIntegrated(const LoudnessStats *s);
+
+// Cached measurements, only loaded if they were taken at the same rate
+// and length.
+bool loudnessSave(const LoudnessStats *s, const char *path, int rate, uint32_t frames);
+bool loudnessLoad(LoudnessStats *s, const char *path, int rate, uint32_t frames);
+
+#endif
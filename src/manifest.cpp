@@ -0,0 +1,138 @@
+/** @file manifest.cpp
+ *
+ * @brief Session manifest reading and writing.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "manifest.h"
+
+#define MANIFEST_MAGIC      "ABOOK-SESSION"
+#define MANIFEST_VERSION    1
+
+void manifestInit(Manifest *m) {
+    memset(m, 0, sizeof(Manifest));
+}
+
+void manifestFree(Manifest *m) {
+    for (int i = 0; i < m->count; i++) {
+        free(m->segments[i].transcript);
+    }
+    free(m->segments);
+    manifestInit(m);
+}
+
+SegmentInfo *manifestSegment(Manifest *m, int n) {
+    if ((n < 1) || (n > m->count)) return NULL;
+    return &m->segments[n - 1];
+}
+
+SegmentInfo *manifestAdd(Manifest *m) {
+    if (m->count == m->capacity) {
+        int cap = m->capacity ? m->capacity * 2 : 64;
+        SegmentInfo *n = (SegmentInfo *)realloc(m->segments, cap * sizeof(SegmentInfo));
+        if (!n) return NULL;
+        m->segments = n;
+        m->capacity = cap;
+    }
+    SegmentInfo *seg = &m->segments[m->count++];
+    memset(seg, 0, sizeof(SegmentInfo));
+    return seg;
+}
+
+void manifestRemoveLast(Manifest *m) {
+    if (m->count == 0) return;
+    m->count--;
+    free(m->segments[m->count].transcript);
+    m->segments[m->count].transcript = NULL;
+}
+
+// Transcripts live on the end of a line, so they can't have line breaks.
+void manifestSetTranscript(SegmentInfo *seg, const char *text) {
+    free(seg->transcript);
+    seg->transcript = strdup(text ? text : "");
+    if (!seg->transcript) return;
+    for (char *p = seg->transcript; *p; p++) {
+        if ((*p == '\n') || (*p == '\r')) *p = ' ';
+    }
+}
+
+// The file looks like:
+//
+//   ABOOK-SESSION 1
+//   rate 48000 noise 1234 segments 2
+//   segment <frames> <first> <last> <peak> <rms> <status> <has text> <text>
+//   ...
+
+bool manifestLoad(Manifest *m, const char *path) {
+    char magic[32];
+    int version, count;
+    char *line = NULL;
+    size_t len = 0;
+
+    manifestInit(m);
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+
+    bool ok = (fscanf(f, "%31s %d", magic, &version) == 2) &&
+        !strcmp(magic, MANIFEST_MAGIC) && (version == MANIFEST_VERSION) &&
+        (fscanf(f, " rate %d noise %d segments %d", &m->rate, &m->noiseFloor, &count) == 3) &&
+        (count >= 0);
+    if (ok) ok = getline(&line, &len, f) > 0;    // rest of the count line
+
+    for (int i = 0; ok && (i < count); i++) {
+        unsigned long frames;
+        long long first, last;
+        int peak, rms, status, hasText, used = 0;
+
+        ok = getline(&line, &len, f) > 0;
+        if (!ok) break;
+        line[strcspn(line, "\n")] = 0;
+
+        ok = sscanf(line, "segment %lu %lld %lld %d %d %d %d %n", &frames, &first, &last,
+            &peak, &rms, &status, &hasText, &used) == 7;
+        if (!ok) break;
+
+        SegmentInfo *seg = manifestAdd(m);
+        ok = seg != NULL;
+        if (!ok) break;
+        seg->frames = frames;
+        seg->first = first;
+        seg->last = last;
+        seg->peak = peak;
+        seg->rms = rms;
+        seg->status = status;
+        if (hasText) {
+            manifestSetTranscript(seg, &line[used]);
+        }
+    }
+
+    free(line);
+    fclose(f);
+    if (!ok) manifestFree(m);
+    return ok;
+}
+
+bool manifestSave(Manifest *m, const char *path) {
+    char temp[1100];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *f = fopen(temp, "w");
+    if (!f) return false;
+
+    fprintf(f, "%s %d\n", MANIFEST_MAGIC, MANIFEST_VERSION);
+    fprintf(f, "rate %d noise %d segments %d\n", m->rate, m->noiseFloor, m->count);
+    for (int i = 0; i < m->count; i++) {
+        SegmentInfo *seg = &m->segments[i];
+        fprintf(f, "segment %lu %lld %lld %d %d %d %d %s\n", (unsigned long)seg->frames,
+            (long long)seg->first, (long long)seg->last, seg->peak, seg->rms,
+            seg->status, seg->transcript != NULL, seg->transcript ? seg->transcript : "");
+    }
+
+    bool ok = !ferror(f);
+    ok = (fclose(f) == 0) && ok;
+    if (ok) ok = rename(temp, path) == 0;
+    if (!ok) unlink(temp);
+    return ok;
+}
@@ -0,0 +1,45 @@
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+#include <stdint.h>
+
+// Everything known about a session's segments, kept in one line-oriented
+// file in the session directory so resuming doesn't have to go looking
+// through the segment files.  It's rewritten under another name and
+// renamed into place on every change.
+
+#define SEGMENT_SPEECH  0
+#define SEGMENT_PULSE   1
+
+struct SegmentInfo {
+    uint32_t frames;        // length of the saved (trimmed) file
+    int64_t first;          // trim points within the original take
+    int64_t last;
+    int peak;
+    int rms;
+    int status;
+    char *transcript;       // NULL until recognition has finished
+};
+
+struct Manifest {
+    int rate;
+    int noiseFloor;
+    int count;
+    int capacity;
+    SegmentInfo *segments;  // segment n is segments[n - 1]
+};
+
+void manifestInit(Manifest *m);
+void manifestFree(Manifest *m);
+
+bool manifestLoad(Manifest *m, const char *path);
+bool manifestSave(Manifest *m, const char *path);
+
+// Segments are numbered from 1; returns NULL if it's out of range.
+SegmentInfo *manifestSegment(Manifest *m, int n);
+
+SegmentInfo *manifestAdd(Manifest *m);
+void manifestRemoveLast(Manifest *m);
+void manifestSetTranscript(SegmentInfo *seg, const char *text);
+
+#endif
@@ -0,0 +1,236 @@
+/** @file peaks.cpp
+ *
+ * @brief Incrementally built waveform summary for the display.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "kernels.h"
+#include "peaks.h"
+
+#define PEAK_MAGIC 0x4b414550   // "PEAK"
+
+struct PeakFileHeader {
+    uint32_t magic;
+    uint32_t baseFrames;
+    uint32_t frames;
+    uint32_t count;
+    int64_t first;
+    int64_t last;
+};
+
+void peaksInit(PeakPyramid *p) {
+    memset(p, 0, sizeof(PeakPyramid));
+    p->first = -1;
+    p->last = -1;
+}
+
+void peaksFree(PeakPyramid *p) {
+    for (int i = 0; i < PEAK_LEVELS; i++) {
+        free(p->level[i]);
+    }
+    peaksInit(p);
+}
+
+void peaksReset(PeakPyramid *p) {
+    for (int i = 0; i < PEAK_LEVELS; i++) {
+        p->count[i] = 0;
+    }
+    p->frames = 0;
+    p->first = -1;
+    p->last = -1;
+    p->pendFrames = 0;
+}
+
+static void push(PeakPyramid *p, int level, Peak peak) {
+    if (p->count[level] == p->capacity[level]) {
+        uint32_t cap = p->capacity[level] ? p->capacity[level] * 2 : 256;
+        Peak *n = (Peak *)realloc(p->level[level], cap * sizeof(Peak));
+        if (!n) return;
+        p->level[level] = n;
+        p->capacity[level] = cap;
+    }
+    p->level[level][p->count[level]++] = peak;
+}
+
+static Peak merge(Peak a, Peak b) {
+    Peak m;
+    m.min = a.min < b.min ? a.min : b.min;
+    m.max = a.max > b.max ? a.max : b.max;
+    m.up = (a.up + b.up) / 2;
+    m.down = (a.down + b.down) / 2;
+    return m;
+}
+
+// Add a finished bucket to level 0 and carry pairs up the pyramid.
+static void emit(PeakPyramid *p) {
+    Peak peak;
+    peak.min = p->pendMin;
+    peak.max = p->pendMax;
+    peak.up = p->pendUpCount ? p->pendUp / p->pendUpCount : 0;
+    peak.down = p->pendDownCount ? p->pendDown / (int64_t)p->pendDownCount : 0;
+    push(p, 0, peak);
+
+    for (int k = 0; (k + 1 < PEAK_LEVELS) && ((p->count[k] & 1) == 0); k++) {
+        Peak *l = p->level[k];
+        push(p, k + 1, merge(l[p->count[k] - 2], l[p->count[k] - 1]));
+    }
+
+    p->pendFrames = 0;
+}
+
+void peaksAdd(PeakPyramid *p, const int16_t *samples, uint32_t frames) {
+    while (frames > 0) {
+        uint32_t n = PEAK_BASE_FRAMES - p->pendFrames;
+        if (n > frames) n = frames;
+
+        PeakStats stats;
+        s16Stats(samples, n * 2, &stats);
+
+        if (p->pendFrames == 0) {
+            p->pendMin = stats.min;
+            p->pendMax = stats.max;
+            p->pendUp = stats.upSum;
+            p->pendUpCount = stats.upCount;
+            p->pendDown = stats.downSum;
+            p->pendDownCount = stats.downCount;
+        } else {
+            if (stats.min < p->pendMin) p->pendMin = stats.min;
+            if (stats.max > p->pendMax) p->pendMax = stats.max;
+            p->pendUp += stats.upSum;
+            p->pendUpCount += stats.upCount;
+            p->pendDown += stats.downSum;
+            p->pendDownCount += stats.downCount;
+        }
+
+        p->pendFrames += n;
+        p->frames += n;
+        samples += n * 2;
+        frames -= n;
+
+        if (p->pendFrames == PEAK_BASE_FRAMES) {
+            emit(p);
+        }
+    }
+}
+
+void peaksFinish(PeakPyramid *p) {
+    if (p->pendFrames > 0) {
+        emit(p);
+    }
+}
+
+bool peaksSave(PeakPyramid *p, const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) return false;
+
+    struct PeakFileHeader header;
+    header.magic = PEAK_MAGIC;
+    header.baseFrames = PEAK_BASE_FRAMES;
+    header.frames = p->frames;
+    header.count = p->count[0];
+    header.first = p->first;
+    header.last = p->last;
+
+    bool ok = write(fd, &header, sizeof(header)) == sizeof(header);
+    size_t len = p->count[0] * sizeof(Peak);
+    if (ok && len) ok = write(fd, p->level[0], len) == (ssize_t)len;
+    close(fd);
+    return ok;
+}
+
+bool peaksLoad(PeakPyramid *p, const char *path) {
+    peaksReset(p);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct PeakFileHeader header;
+    if ((read(fd, &header, sizeof(header)) != sizeof(header)) ||
+        (header.magic != PEAK_MAGIC) ||
+        (header.baseFrames != PEAK_BASE_FRAMES)) {
+        close(fd);
+        return false;
+    }
+
+    Peak buffer[256];
+    uint32_t left = header.count;
+    while (left > 0) {
+        uint32_t n = left > 256 ? 256 : left;
+        if (read(fd, buffer, n * sizeof(Peak)) != (ssize_t)(n * sizeof(Peak))) break;
+        for (uint32_t i = 0; i < n; i++) {
+            p->pendMin = buffer[i].min;
+            p->pendMax = buffer[i].max;
+            p->pendUp = buffer[i].up;
+            p->pendUpCount = 1;
+            p->pendDown = buffer[i].down;
+            p->pendDownCount = 1;
+            emit(p);
+        }
+        left -= n;
+    }
+    close(fd);
+
+    p->frames = header.frames;
+    p->first = header.first;
+    p->last = header.last;
+    return left == 0;
+}
+
+struct PeakAccumulator {
+    int min, max;
+    int64_t up, down;
+    int64_t weight;
+};
+
+// Merge buckets b0..b1-1 of a level.  Anything past the end of the level
+// that hasn't been carried up yet is picked up from the level below.
+static void gather(PeakPyramid *p, int level, uint32_t b0, uint32_t b1, PeakAccumulator *acc) {
+    uint32_t end = b1 < p->count[level] ? b1 : p->count[level];
+    int64_t w = 1 << level;
+
+    for (uint32_t i = b0; i < end; i++) {
+        Peak *pk = &p->level[level][i];
+        if (pk->min < acc->min) acc->min = pk->min;
+        if (pk->max > acc->max) acc->max = pk->max;
+        acc->up += pk->up * w;
+        acc->down += pk->down * w;
+        acc->weight += w;
+    }
+
+    if ((b1 > p->count[level]) && (level > 0)) {
+        uint32_t from = b0 > p->count[level] ? b0 : p->count[level];
+        gather(p, level - 1, from * 2, b1 * 2, acc);
+    }
+}
+
+void peaksRender(PeakPyramid *p, Peak *cols, int ncols) {
+    uint32_t perCol = p->frames / ncols;
+
+    // Pick a level with a few buckets per column so the edges line up
+    // reasonably well, without touching more than a handful per column.
+    int level = 0;
+    while ((level + 1 < PEAK_LEVELS) && ((uint32_t)(PEAK_BASE_FRAMES << (level + 1)) * 4 <= perCol)) {
+        level++;
+    }
+    uint64_t bucket = PEAK_BASE_FRAMES << level;
+
+    for (int c = 0; c < ncols; c++) {
+        uint64_t start = (uint64_t)p->frames * c / ncols;
+        uint64_t end = (uint64_t)p->frames * (c + 1) / ncols;
+        uint32_t b0 = start / bucket;
+        uint32_t b1 = (end + bucket - 1) / bucket;
+        if (b1 <= b0) b1 = b0 + 1;
+
+        PeakAccumulator acc = { 0, 0, 0, 0, 0 };
+        gather(p, level, b0, b1, &acc);
+
+        cols[c].min = acc.min;
+        cols[c].max = acc.max;
+        cols[c].up = acc.weight ? acc.up / acc.weight : 0;
+        cols[c].down = acc.weight ? acc.down / acc.weight : 0;
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef _PEAKS_H
+#define _PEAKS_H
+
+#include <stdint.h>
+
+// A min/max/mean summary of a take, built up block by block as it is
+// recorded.  Level 0 holds one Peak for every PEAK_BASE_FRAMES frames and
+// each level above halves the resolution, so any zoom can be drawn from
+// a handful of entries.  The pyramid is saved next to the segment as
+// segment-NNNN.pk.
+
+#define PEAK_BASE_FRAMES 256
+#define PEAK_LEVELS 20
+
+struct Peak {
+    int16_t min;
+    int16_t max;
+    int16_t up;     // mean of the positive samples
+    int16_t down;   // mean of the negative samples
+};
+
+struct PeakPyramid {
+    Peak *level[PEAK_LEVELS];
+    uint32_t count[PEAK_LEVELS];
+    uint32_t capacity[PEAK_LEVELS];
+    uint32_t frames;
+    int64_t first;      // kept range after trimming, in take frames
+    int64_t last;
+
+    // Bucket still being filled
+    int pendMin, pendMax;
+    int64_t pendUp, pendDown;
+    uint32_t pendUpCount, pendDownCount;
+    uint32_t pendFrames;
+};
+
+void peaksInit(PeakPyramid *p);
+void peaksFree(PeakPyramid *p);
+void peaksReset(PeakPyramid *p);
+
+// Add interleaved stereo frames.
+void peaksAdd(PeakPyramid *p, const int16_t *samples, uint32_t frames);
+
+// Flush the last partial bucket.
+void peaksFinish(PeakPyramid *p);
+
+bool peaksSave(PeakPyramid *p, const char *path);
+bool peaksLoad(PeakPyramid *p, const char *path);
+
+// Summarise the whole take into ncols columns.
+void peaksRender(PeakPyramid *p, Peak *cols, int ncols);
+
+#endif
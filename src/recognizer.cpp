@@ -0,0 +1,425 @@
+/** @file recognizer.cpp
+ *
+ * @brief Persistent pocketsphinx worker thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <SDL2/SDL.h>
+#include <pocketsphinx.h>
+#include "ringbuffer.h"
+#include "resample.h"
+#include "wavfile.h"
+#include "events.h"
+#include "segwriter.h"
+#include "recognizer.h"
+#include "stats.h"
+
+#define RECOGNIZER_RATE 16000
+#define STREAM_RING_FRAMES (RECOGNIZER_RATE * 30)
+#define PARTIAL_INTERVAL (RECOGNIZER_RATE / 2)
+
+struct RecognitionJob {
+    int segment;
+    char wavfile[1024];
+    char txtfile[1024];
+
+    // Streamed jobs get their audio through the ring rather than the file.
+    // The main thread owns the producer side until it sets ended; after
+    // that the job belongs to the worker.
+    int streaming;
+    RingBuffer ring;
+    int overflow;
+    int ended;
+    uint64_t endedAt;   // when the main thread ended it, for TIMER_STREAM
+
+    // Set under the lock when the take is undone; nothing is written or
+    // posted for it after that
+    int cancelled;
+
+    RecognitionJob *next;
+};
+
+static cmd_ln_t *recognizerConfig = NULL;
+static SDL_Thread *recognizerThread = NULL;
+static SDL_mutex *recognizerLock = NULL;
+static SDL_cond *recognizerWake = NULL;
+static RecognitionJob *jobHead = NULL;
+static RecognitionJob *jobTail = NULL;
+static int recognizerRunning = 0;
+static RecognitionJob *streamJob = NULL;
+static RecognitionJob *currentJob = NULL;
+
+// One resampler for each side; the stream is fed from the main thread
+// and files are read on the worker.
+static int captureChannels = 2;
+static Resampler streamResampler;
+static Resampler fileResampler;
+static int16_t *streamOut = NULL;
+static int16_t *fileOut = NULL;
+static int fileRate = 0;
+static int fileChannels = 0;
+
+static char partialText[1024] = "";
+
+// Write it under another name first so nobody sees half a transcript.
+// The lock keeps cancelRecognition() from unlinking it half way.
+static void writeTranscript(ps_decoder_t *ps, RecognitionJob *job) {
+    int32_t score = 0;
+    const char *out = ps_get_hyp(ps, &score);
+
+    SDL_LockMutex(recognizerLock);
+    if (job->cancelled) {
+        SDL_UnlockMutex(recognizerLock);
+        return;
+    }
+    char temp[1040];
+    sprintf(temp, "%s.tmp", job->txtfile);
+    FILE *tf = fopen(temp, "w");
+    if (tf) {
+        if (out) fputs(out, tf);
+        fclose(tf);
+        rename(temp, job->txtfile);
+    } else {
+        printf("Unable to write %s\n", job->txtfile);
+    }
+    SDL_UnlockMutex(recognizerLock);
+}
+
+// Files recorded with different settings need a different filter.
+static bool setFileFormat(int rate, int channels) {
+    if ((rate == fileRate) && (channels == fileChannels)) return true;
+
+    resamplerFree(&fileResampler);
+    free(fileOut);
+    fileOut = NULL;
+    fileRate = 0;
+
+    if (!resamplerInit(&fileResampler, rate, RECOGNIZER_RATE, channels)) return false;
+    fileOut = (int16_t *)malloc(resamplerMaxOutput(&fileResampler, RESAMPLE_BLOCK_FRAMES) * sizeof(int16_t));
+    if (!fileOut) return false;
+    fileRate = rate;
+    fileChannels = channels;
+    return true;
+}
+
+static void processSpeech(ps_decoder_t *ps, RecognitionJob *job) {
+    // The writer may not have finished the file off yet
+    waitForSegmentFiles();
+
+    uint64_t start = SDL_GetPerformanceCounter();
+    struct WavView view;
+    if (!wavOpen(&view, job->wavfile)) return;
+    if (!setFileFormat(view.rate, view.channels)) {
+        printf("Unable to resample %s\n", job->wavfile);
+        wavClose(&view);
+        return;
+    }
+
+    ps_start_utt(ps);
+    resamplerReset(&fileResampler);
+
+    // Feed the segment through in blocks so its length doesn't matter
+    const int16_t *samples = view.samples;
+    uint32_t left = view.frames;
+    while (left > 0) {
+        uint32_t frames = left > RESAMPLE_BLOCK_FRAMES ? RESAMPLE_BLOCK_FRAMES : left;
+        uint32_t n = resamplerProcess(&fileResampler, samples, frames, fileOut);
+        ps_process_raw(ps, fileOut, n, FALSE, FALSE);
+        samples += frames * view.channels;
+        left -= frames;
+    }
+    wavClose(&view);
+
+    ps_end_utt(ps);
+    writeTranscript(ps, job);
+    statsTime(TIMER_SPEECH, start);
+}
+
+static void publishPartial(ps_decoder_t *ps, RecognitionJob *job) {
+    int32_t score = 0;
+    const char *out = ps_get_hyp(ps, &score);
+
+    SDL_LockMutex(recognizerLock);
+    snprintf(partialText, sizeof(partialText), "%s", out ? out : "");
+    SDL_UnlockMutex(recognizerLock);
+    pushUserEvent(EVENT_PARTIAL, job->segment);
+}
+
+// Decode audio as the main thread pushes it in, until the take ends.
+static void streamSpeech(ps_decoder_t *ps, RecognitionJob *job) {
+    uint32_t sinceHyp = 0;
+
+    ps_start_utt(ps);
+
+    while (1) {
+        const int16_t *data;
+        uint32_t n = ringReadPtr(&job->ring, &data);
+        if (n > 0) {
+            ps_process_raw(ps, data, n, FALSE, FALSE);
+            ringCommitRead(&job->ring, n);
+            sinceHyp += n;
+            if (sinceHyp >= PARTIAL_INTERVAL) {
+                sinceHyp = 0;
+                publishPartial(ps, job);
+            }
+            continue;
+        }
+
+        SDL_LockMutex(recognizerLock);
+        while (!job->ended && (ringReadAvail(&job->ring) == 0)) {
+            SDL_CondWait(recognizerWake, recognizerLock);
+        }
+        int ended = job->ended;
+        SDL_UnlockMutex(recognizerLock);
+
+        if (ended && (ringReadAvail(&job->ring) == 0)) break;
+    }
+
+    ps_end_utt(ps);
+
+    // We fell too far behind and lost some of it; go back to the file.
+    if (job->overflow) {
+        processSpeech(ps, job);
+    } else {
+        writeTranscript(ps, job);
+    }
+    statsTime(TIMER_STREAM, job->endedAt);
+}
+
+static int recognizerMain(void *arg) {
+    ps_decoder_t *ps = ps_init(recognizerConfig);
+
+    if (!ps) {
+        printf("Error initialising speech system\n");
+    }
+
+    SDL_LockMutex(recognizerLock);
+    while (1) {
+        while (!jobHead && recognizerRunning) {
+            SDL_CondWait(recognizerWake, recognizerLock);
+        }
+        if (!jobHead) break;
+
+        RecognitionJob *job = jobHead;
+        jobHead = job->next;
+        if (!jobHead) jobTail = NULL;
+        currentJob = job;
+        SDL_UnlockMutex(recognizerLock);
+
+        if (job->streaming) {
+            if (ps) {
+                streamSpeech(ps, job);
+            } else {
+                // Still have to wait for the producer to let go of it
+                SDL_LockMutex(recognizerLock);
+                while (!job->ended) {
+                    SDL_CondWait(recognizerWake, recognizerLock);
+                }
+                SDL_UnlockMutex(recognizerLock);
+            }
+            ringFree(&job->ring);
+        } else if (ps) {
+            processSpeech(ps, job);
+        }
+
+        SDL_LockMutex(recognizerLock);
+        if (ps && !job->cancelled) {
+            pushUserEvent(EVENT_TRANSCRIPT, job->segment);
+        }
+        currentJob = NULL;
+        free(job);
+    }
+    SDL_UnlockMutex(recognizerLock);
+
+    if (ps) ps_free(ps);
+    return 0;
+}
+
+cmd_ln_t *defaultRecognizerConfig() {
+    return cmd_ln_init(NULL, ps_args(), TRUE,
+                       "-hmm", "/usr/share/sphinx-voxforge-en/hmm/voxforge_en_sphinx.cd_cont_3000/",
+                       "-lm", "/usr/share/sphinx-voxforge-en/lm/voxforge_en_sphinx.cd_cont_3000/voxforge_en_sphinx.lm.DMP",
+                       "-dict", "/usr/share/sphinx-voxforge-en/lm/voxforge_en_sphinx.cd_cont_3000/voxforge_en_sphinx.dic",
+                       NULL);
+}
+
+bool startRecognizer(cmd_ln_t *config, int rate, int channels) {
+    recognizerConfig = config;
+    captureChannels = channels;
+
+    if (!resamplerInit(&streamResampler, rate, RECOGNIZER_RATE, channels)) {
+        printf("Unable to set up resampling from %dHz\n", rate);
+        return false;
+    }
+    streamOut = (int16_t *)malloc(resamplerMaxOutput(&streamResampler, RESAMPLE_BLOCK_FRAMES) * sizeof(int16_t));
+    if (!streamOut || !setFileFormat(rate, 2)) {
+        printf("Out of memory\n");
+        return false;
+    }
+    recognizerLock = SDL_CreateMutex();
+    recognizerWake = SDL_CreateCond();
+    recognizerRunning = 1;
+    recognizerThread = SDL_CreateThread(recognizerMain, "recognizer", NULL);
+    if (!recognizerThread) {
+        printf("Unable to start recognizer thread: %s\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+// Anything still queued is finished off before this returns.
+void stopRecognizer() {
+    if (!recognizerThread) return;
+    endRecognitionStream();
+    SDL_LockMutex(recognizerLock);
+    recognizerRunning = 0;
+    SDL_CondSignal(recognizerWake);
+    SDL_UnlockMutex(recognizerLock);
+    SDL_WaitThread(recognizerThread, NULL);
+    recognizerThread = NULL;
+
+    resamplerFree(&streamResampler);
+    resamplerFree(&fileResampler);
+    free(streamOut);
+    free(fileOut);
+    streamOut = NULL;
+    fileOut = NULL;
+    fileRate = 0;
+}
+
+static RecognitionJob *newJob(int segment, const char *wavfile, const char *txtfile) {
+    RecognitionJob *job = (RecognitionJob *)malloc(sizeof(RecognitionJob));
+    if (!job) return NULL;
+    memset(job, 0, sizeof(RecognitionJob));
+    job->segment = segment;
+    snprintf(job->wavfile, sizeof(job->wavfile), "%s", wavfile);
+    snprintf(job->txtfile, sizeof(job->txtfile), "%s", txtfile);
+    return job;
+}
+
+static void queueJob(RecognitionJob *job) {
+    SDL_LockMutex(recognizerLock);
+    if (jobTail) {
+        jobTail->next = job;
+    } else {
+        jobHead = job;
+    }
+    jobTail = job;
+    SDL_CondSignal(recognizerWake);
+    SDL_UnlockMutex(recognizerLock);
+}
+
+void queueRecognition(int segment, const char *wavfile, const char *txtfile) {
+    if (!recognizerThread) return;
+    RecognitionJob *job = newJob(segment, wavfile, txtfile);
+    if (job) queueJob(job);
+}
+
+bool beginRecognitionStream(int segment, const char *wavfile, const char *txtfile) {
+    if (!recognizerThread) return false;
+    if (streamJob) endRecognitionStream();
+
+    RecognitionJob *job = newJob(segment, wavfile, txtfile);
+    if (!job) return false;
+    if (!ringInit(&job->ring, STREAM_RING_FRAMES, 1)) {
+        free(job);
+        return false;
+    }
+    job->streaming = 1;
+    resamplerReset(&streamResampler);
+
+    SDL_LockMutex(recognizerLock);
+    partialText[0] = 0;
+    SDL_UnlockMutex(recognizerLock);
+
+    streamJob = job;
+    queueJob(job);
+    return true;
+}
+
+// Takes interleaved frames at the capture rate, resamples them to what
+// the decoder wants and passes them on to the worker.
+void feedRecognitionStream(const int16_t *samples, uint32_t frames) {
+    RecognitionJob *job = streamJob;
+    if (!job || job->overflow) return;
+
+    while (frames > 0) {
+        uint32_t n = frames > RESAMPLE_BLOCK_FRAMES ? RESAMPLE_BLOCK_FRAMES : frames;
+        uint32_t len = resamplerProcess(&streamResampler, samples, n, streamOut);
+        samples += n * captureChannels;
+        frames -= n;
+
+        if (ringWriteSpace(&job->ring) < len) {
+            job->overflow = 1;
+            return;
+        }
+
+        const int16_t *src = streamOut;
+        while (len > 0) {
+            int16_t *out;
+            uint32_t space = ringWritePtr(&job->ring, &out);
+            if (space > len) space = len;
+            memcpy(out, src, space * sizeof(int16_t));
+            ringCommitWrite(&job->ring, space);
+            src += space;
+            len -= space;
+        }
+    }
+
+    SDL_LockMutex(recognizerLock);
+    SDL_CondSignal(recognizerWake);
+    SDL_UnlockMutex(recognizerLock);
+}
+
+// Returns false if there wasn't a stream running.
+bool endRecognitionStream() {
+    RecognitionJob *job = streamJob;
+    if (!job) return false;
+    streamJob = NULL;
+
+    SDL_LockMutex(recognizerLock);
+    job->endedAt = SDL_GetPerformanceCounter();
+    job->ended = 1;
+    SDL_CondSignal(recognizerWake);
+    SDL_UnlockMutex(recognizerLock);
+    return true;
+}
+
+void cancelRecognition(int segment) {
+    if (!recognizerThread) return;
+
+    SDL_LockMutex(recognizerLock);
+    RecognitionJob *prev = NULL;
+    RecognitionJob *job = jobHead;
+    while (job) {
+        RecognitionJob *next = job->next;
+        // A stream still being fed belongs to the main thread
+        if ((job->segment == segment) && (job != streamJob)) {
+            if (prev) {
+                prev->next = next;
+            } else {
+                jobHead = next;
+            }
+            if (jobTail == job) jobTail = prev;
+            if (job->streaming) ringFree(&job->ring);
+            free(job);
+        } else {
+            prev = job;
+        }
+        job = next;
+    }
+    if (currentJob && (currentJob->segment == segment)) {
+        currentJob->cancelled = 1;
+    }
+    SDL_UnlockMutex(recognizerLock);
+}
+
+void getPartialTranscript(char *buffer, size_t len) {
+    SDL_LockMutex(recognizerLock);
+    snprintf(buffer, len, "%s", partialText);
+    SDL_UnlockMutex(recognizerLock);
+}
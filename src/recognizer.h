@@ -0,0 +1,38 @@
+#ifndef _RECOGNIZER_H
+#define _RECOGNIZER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <pocketsphinx.h>
+
+// A single long-lived speech recognition worker.  The decoder is set up
+// once and segments are queued to it as they are recorded; each one's
+// transcript is written next to it and EVENT_TRANSCRIPT is posted.
+//
+// A segment can either be queued once its file is finished, or streamed
+// to the worker while it's being recorded.  Streaming posts
+// EVENT_PARTIAL every so often with the hypothesis so far.
+//
+// Without startRecognizer() nothing is recognised, and queueing or
+// streaming segments does nothing.
+
+// The English voxforge model, from where Debian installs it
+cmd_ln_t *defaultRecognizerConfig();
+
+bool startRecognizer(cmd_ln_t *config, int rate, int channels);
+void stopRecognizer();
+
+void queueRecognition(int segment, const char *wavfile, const char *txtfile);
+
+bool beginRecognitionStream(int segment, const char *wavfile, const char *txtfile);
+void feedRecognitionStream(const int16_t *samples, uint32_t frames);
+bool endRecognitionStream();
+
+// Forget a segment that's being thrown away, whether it's still queued
+// or being worked on.  Once this returns its transcript won't be
+// written, and EVENT_TRANSCRIPT won't be posted for it.
+void cancelRecognition(int segment);
+
+void getPartialTranscript(char *buffer, size_t len);
+
+#endif
@@ -0,0 +1,152 @@
+/** @file resample.cpp
+ *
+ * @brief Polyphase FIR sample rate conversion.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "kernels.h"
+#include "resample.h"
+
+// Taps per phase for each step of decimation.  At 48k -> 16k that's 96
+// taps, a transition band a couple of kHz wide around 7kHz.
+#define TAPS_PER_STEP 32
+
+// Kaiser window shape; about 80dB of stopband.
+#define KAISER_BETA 8.0
+
+// Edge of the passband as a fraction of the narrower Nyquist.
+#define CUTOFF 0.9
+
+static int gcd(int a, int b) {
+    while (b) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+// Modified Bessel function of the first kind, order 0
+static double bessel0(double x) {
+    double sum = 1, term = 1;
+    for (int k = 1; k < 50; k++) {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+        if (term < sum * 1e-12) break;
+    }
+    return sum;
+}
+
+void designLowpass(double *h, int len, double fc) {
+    double sum = 0;
+    double mid = (len - 1) / 2.0;
+    for (int n = 0; n < len; n++) {
+        double t = n - mid;
+        double sinc = t == 0 ? 2 * fc : sin(2 * M_PI * fc * t) / (M_PI * t);
+        double w = t / (mid + 1);
+        h[n] = sinc * bessel0(KAISER_BETA * sqrt(1 - w * w)) / bessel0(KAISER_BETA);
+        sum += h[n];
+    }
+    for (int n = 0; n < len; n++) {
+        h[n] /= sum;
+    }
+}
+
+bool resamplerInit(Resampler *r, int inRate, int outRate, int channels) {
+    memset(r, 0, sizeof(Resampler));
+
+    int g = gcd(inRate, outRate);
+    r->channels = channels;
+    r->up = outRate / g;
+    r->down = inRate / g;
+    r->taps = TAPS_PER_STEP * ((r->down + r->up - 1) / r->up);
+
+    // Designed at the upsampled rate, cut off below whichever Nyquist is
+    // lower.
+    int len = r->up * r->taps;
+    double *h = (double *)malloc(len * sizeof(double));
+    if (!h) return false;
+    designLowpass(h, len, CUTOFF * 0.5 / (r->up > r->down ? r->up : r->down));
+
+    // Unity gain through each phase once the zero stuffing is accounted for
+    r->coeffs = (float *)malloc(len * sizeof(float));
+    r->buffer = (float *)malloc((r->taps - 1 + RESAMPLE_BLOCK_FRAMES) * sizeof(float));
+    if (!r->coeffs || !r->buffer) {
+        free(h);
+        resamplerFree(r);
+        return false;
+    }
+
+    for (int p = 0; p < r->up; p++) {
+        for (int j = 0; j < r->taps; j++) {
+            r->coeffs[p * r->taps + (r->taps - 1 - j)] = h[p + j * r->up] * r->up;
+        }
+    }
+    free(h);
+
+    resamplerReset(r);
+    return true;
+}
+
+void resamplerFree(Resampler *r) {
+    free(r->coeffs);
+    free(r->buffer);
+    r->coeffs = NULL;
+    r->buffer = NULL;
+}
+
+void resamplerReset(Resampler *r) {
+    memset(r->buffer, 0, (r->taps - 1) * sizeof(float));
+    r->pos = r->taps - 1;
+    r->phase = 0;
+}
+
+uint32_t resamplerMaxOutput(Resampler *r, uint32_t frames) {
+    return (uint64_t)frames * r->up / r->down + 1;
+}
+
+static inline int16_t clip16(float v) {
+    v = v < 0 ? v - 0.5f : v + 0.5f;
+    if (v > 32767) return 32767;
+    if (v < -32768) return -32768;
+    return (int16_t)v;
+}
+
+uint32_t resamplerProcess(Resampler *r, const int16_t *in, uint32_t frames, int16_t *out) {
+    uint32_t history = r->taps - 1;
+    uint32_t produced = 0;
+    float scale = 1.0f / r->channels;
+
+    while (frames > 0) {
+        uint32_t n = frames > RESAMPLE_BLOCK_FRAMES ? RESAMPLE_BLOCK_FRAMES : frames;
+
+        // Downmix the block in after the history
+        float *dst = &r->buffer[history];
+        for (uint32_t i = 0; i < n; i++) {
+            int v = 0;
+            for (int c = 0; c < r->channels; c++) {
+                v += in[c];
+            }
+            dst[i] = v * scale;
+            in += r->channels;
+        }
+        uint32_t end = history + n;
+
+        while (r->pos < end) {
+            const float *c = &r->coeffs[r->phase * r->taps];
+            out[produced++] = clip16(f32Dot(c, &r->buffer[r->pos - history], r->taps));
+
+            r->phase += r->down;
+            r->pos += r->phase / r->up;
+            r->phase %= r->up;
+        }
+
+        // Keep the tail as history for the next block
+        memmove(r->buffer, &r->buffer[n], history * sizeof(float));
+        r->pos -= n;
+        frames -= n;
+    }
+    return produced;
+}
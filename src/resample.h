@@ -0,0 +1,41 @@
+#ifndef _RESAMPLE_H
+#define _RESAMPLE_H
+
+#include <stdint.h>
+
+// Streaming polyphase FIR resampler.  Interleaved S16 at any rate goes in
+// and comes out downmixed to mono at the output rate.  The rate ratio is
+// reduced to up / down and the low-pass filter is split into "up" phases,
+// so only the taps that land on a real input sample are ever computed.
+//
+// Everything it needs is allocated by resamplerInit(); processing never
+// allocates, and blocks of any length can be fed in.
+
+#define RESAMPLE_BLOCK_FRAMES 1024
+
+struct Resampler {
+    int channels;
+    int up;             // interpolation factor
+    int down;           // decimation factor
+    int taps;           // per phase
+    float *coeffs;      // up * taps, each phase stored reversed
+    float *buffer;      // taps - 1 samples of history, then a block
+    uint32_t pos;       // index in buffer of the next output's newest input
+    uint32_t phase;     // and which phase it uses
+};
+
+bool resamplerInit(Resampler *r, int inRate, int outRate, int channels);
+void resamplerFree(Resampler *r);
+void resamplerReset(Resampler *r);
+
+// Most output samples that feeding this many input frames can produce
+uint32_t resamplerMaxOutput(Resampler *r, uint32_t frames);
+
+// Returns the number of mono samples written to out
+uint32_t resamplerProcess(Resampler *r, const int16_t *in, uint32_t frames, int16_t *out);
+
+// Kaiser windowed sinc low-pass of len taps with its edge at fc, as a
+// fraction of the sample rate, scaled for unity gain at DC.
+void designLowpass(double *h, int len, double fc);
+
+#endif
@@ -0,0 +1,88 @@
+#ifndef _RINGBUFFER_H
+#define _RINGBUFFER_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Lock-free single-producer / single-consumer ring of interleaved S16 frames.
+//
+// The producer only ever moves head and the consumer only ever moves tail,
+// so the two sides never need a lock.  Both counters run freely and wrap
+// at 2^32; the buffer size is a power of two so they can be masked.
+
+struct RingBuffer {
+    int16_t *data;
+    uint32_t size;      // in frames
+    uint32_t mask;
+    int channels;
+    uint32_t head;      // producer position
+    uint32_t tail;      // consumer position
+};
+
+static inline bool ringInit(RingBuffer *rb, uint32_t frames, int channels) {
+    uint32_t size = 1;
+    while (size < frames) size <<= 1;
+    rb->data = (int16_t *)malloc(size * channels * sizeof(int16_t));
+    if (!rb->data) return false;
+    rb->size = size;
+    rb->mask = size - 1;
+    rb->channels = channels;
+    rb->head = 0;
+    rb->tail = 0;
+    return true;
+}
+
+static inline void ringFree(RingBuffer *rb) {
+    free(rb->data);
+    rb->data = NULL;
+}
+
+// Frames waiting to be read.  Safe to call from either side.
+static inline uint32_t ringReadAvail(RingBuffer *rb) {
+    uint32_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+    return head - tail;
+}
+
+static inline uint32_t ringWriteSpace(RingBuffer *rb) {
+    return rb->size - ringReadAvail(rb);
+}
+
+// Producer side: get the largest contiguous writable region.
+static inline uint32_t ringWritePtr(RingBuffer *rb, int16_t **ptr) {
+    uint32_t head = rb->head;
+    uint32_t tail = __atomic_load_n(&rb->tail, __ATOMIC_ACQUIRE);
+    uint32_t space = rb->size - (head - tail);
+    uint32_t pos = head & rb->mask;
+    uint32_t contig = rb->size - pos;
+    *ptr = &rb->data[pos * rb->channels];
+    return space < contig ? space : contig;
+}
+
+static inline void ringCommitWrite(RingBuffer *rb, uint32_t frames) {
+    __atomic_store_n(&rb->head, rb->head + frames, __ATOMIC_RELEASE);
+}
+
+// Consumer side: get the largest contiguous readable region.
+static inline uint32_t ringReadPtr(RingBuffer *rb, const int16_t **ptr) {
+    uint32_t tail = rb->tail;
+    uint32_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+    uint32_t avail = head - tail;
+    uint32_t pos = tail & rb->mask;
+    uint32_t contig = rb->size - pos;
+    *ptr = &rb->data[pos * rb->channels];
+    return avail < contig ? avail : contig;
+}
+
+static inline void ringCommitRead(RingBuffer *rb, uint32_t frames) {
+    __atomic_store_n(&rb->tail, rb->tail + frames, __ATOMIC_RELEASE);
+}
+
+// Consumer side: throw away everything currently buffered.
+static inline void ringFlush(RingBuffer *rb) {
+    uint32_t head = __atomic_load_n(&rb->head, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&rb->tail, head, __ATOMIC_RELEASE);
+}
+
+#endif
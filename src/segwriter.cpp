@@ -0,0 +1,394 @@
+/** @file segwriter.cpp
+ *
+ * @brief Write-behind streaming of segments to disk.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <SDL2/SDL.h>
+#include "wavfile.h"
+#include "events.h"
+#include "segwriter.h"
+
+// A file from when it's opened until the writer has closed it.  Its
+// finish block goes in the queue after the last of its audio.
+struct SegmentFile {
+    int fd;
+    int id;
+    uint32_t frames;    // what's left in it once it's cut off
+    int error;
+    WriteBlock finish;
+};
+
+static int writerRate = 48000;
+static int writerChannels = 2;
+
+static WriteBlock *freeBlocks = NULL;
+static WriteBlock *queueHead = NULL;
+static WriteBlock *queueTail = NULL;
+static WriteBlock *currentBlock = NULL;
+static WriteBlock *heldHead = NULL;
+static WriteBlock *heldTail = NULL;
+
+static SDL_mutex *writerLock = NULL;
+static SDL_cond *writerWake = NULL;
+static SDL_cond *writerDone = NULL;
+static SDL_Thread *writerThread = NULL;
+static int writerRunning = 0;
+static uint32_t finishQueued = 0;
+static uint32_t finishDone = 0;
+
+static SegmentFile *streamFile = NULL;
+static uint32_t streamFrames = 0;
+static uint32_t streamBase = 0;     // take frame that starts the file
+static uint32_t heldBase = 0;       // take frame that starts heldHead
+static uint32_t leadInFrames = 0;
+static int holding = 0;
+
+static bool writeAll(int fd, const void *buffer, size_t len) {
+    const char *p = (const char *)buffer;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool pwriteAll(int fd, const void *buffer, size_t len, off_t pos) {
+    const char *p = (const char *)buffer;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, pos);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        pos += n;
+        len -= n;
+    }
+    return true;
+}
+
+// Cut the file off at the trim point, fill in the header and make sure
+// it's all on the card before saying so.  Anything past the trim point
+// is already on disk, so it's truncated rather than rewritten.
+static bool finishFile(SegmentFile *f) {
+    int frameSize = writerChannels * sizeof(int16_t);
+    bool ok = !f->error;
+
+    struct wav header;
+    fillWavHeader(&header, writerRate, f->frames);
+    if (ok) ok = pwriteAll(f->fd, &header, sizeof(header), 0);
+    if (ok) ok = ftruncate(f->fd, sizeof(header) + (off_t)f->frames * frameSize) == 0;
+    if (ok) ok = fsync(f->fd) == 0;
+    if (!ok && !f->error) {
+        printf("Error finishing segment %d: %s\n", f->id, strerror(errno));
+    }
+    if (close(f->fd) < 0) ok = false;
+    return ok;
+}
+
+static int writerMain(void *arg) {
+    SDL_LockMutex(writerLock);
+    while (1) {
+        while (!queueHead && writerRunning) {
+            SDL_CondWait(writerWake, writerLock);
+        }
+        if (!queueHead) break;
+
+        WriteBlock *b = queueHead;
+        queueHead = b->next;
+        if (!queueHead) queueTail = NULL;
+        SDL_UnlockMutex(writerLock);
+
+        SegmentFile *f = b->file;
+        if (b == &f->finish) {
+            bool ok = finishFile(f);
+            pushUserEvent(ok ? EVENT_SEGMENT : EVENT_SEGMENT_FAILED, f->id);
+            free(f);
+
+            SDL_LockMutex(writerLock);
+            finishDone++;
+            SDL_CondBroadcast(writerDone);
+            continue;
+        }
+
+        // After one failure the rest of the file is no use, but its
+        // blocks still have to go back in the pool.
+        if (!f->error && !writeAll(f->fd, &b->data[b->offset * writerChannels],
+            (b->frames - b->offset) * writerChannels * sizeof(int16_t))) {
+            printf("Error writing segment: %s\n", strerror(errno));
+            f->error = 1;
+        }
+
+        SDL_LockMutex(writerLock);
+        b->next = freeBlocks;
+        freeBlocks = b;
+    }
+    SDL_UnlockMutex(writerLock);
+    return 0;
+}
+
+bool initSegmentWriter(int rate, int channels) {
+    writerRate = rate;
+    writerChannels = channels;
+
+    for (int i = 0; i < WRITE_POOL_BLOCKS; i++) {
+        WriteBlock *b = (WriteBlock *)malloc(sizeof(WriteBlock));
+        if (!b) return false;
+        b->data = (int16_t *)malloc(WRITE_BLOCK_FRAMES * channels * sizeof(int16_t));
+        if (!b->data) return false;
+        b->frames = 0;
+        b->offset = 0;
+        b->next = freeBlocks;
+        freeBlocks = b;
+    }
+
+    writerLock = SDL_CreateMutex();
+    writerWake = SDL_CreateCond();
+    writerDone = SDL_CreateCond();
+    writerRunning = 1;
+    writerThread = SDL_CreateThread(writerMain, "segwriter", NULL);
+    if (!writerThread) {
+        printf("Unable to start writer thread: %s\n", SDL_GetError());
+        return false;
+    }
+    return true;
+}
+
+void shutdownSegmentWriter() {
+    if (!writerThread) return;
+    SDL_LockMutex(writerLock);
+    writerRunning = 0;
+    SDL_CondSignal(writerWake);
+    SDL_UnlockMutex(writerLock);
+    SDL_WaitThread(writerThread, NULL);
+    writerThread = NULL;
+}
+
+static WriteBlock *getBlock() {
+    SDL_LockMutex(writerLock);
+    WriteBlock *b = freeBlocks;
+    if (b) {
+        freeBlocks = b->next;
+        b->frames = 0;
+        b->offset = 0;
+        b->next = NULL;
+    }
+    SDL_UnlockMutex(writerLock);
+    return b;
+}
+
+static void releaseBlock(WriteBlock *b) {
+    SDL_LockMutex(writerLock);
+    b->next = freeBlocks;
+    freeBlocks = b;
+    SDL_UnlockMutex(writerLock);
+}
+
+// Keep a full block back while we're still in the lead-in.
+static void holdBlock(WriteBlock *b) {
+    b->next = NULL;
+    if (heldTail) {
+        heldTail->next = b;
+    } else {
+        heldHead = b;
+    }
+    heldTail = b;
+}
+
+// Recycle the oldest held blocks once there's more than leadInFrames
+// behind them.  Only frames from earlier calls count towards that, as
+// the caller won't have looked at the ones it's handing over now; a
+// crossing in those still has its whole margin in front of it.
+static void releaseHeld() {
+    while (heldHead && (streamFrames - heldBase - heldHead->frames >= leadInFrames)) {
+        WriteBlock *old = heldHead;
+        heldHead = old->next;
+        if (!heldHead) heldTail = NULL;
+        heldBase += old->frames;
+        releaseBlock(old);
+    }
+}
+
+static void queueBlock(WriteBlock *b) {
+    SDL_LockMutex(writerLock);
+    b->file = streamFile;
+    b->next = NULL;
+    if (queueTail) {
+        queueTail->next = b;
+    } else {
+        queueHead = b;
+    }
+    queueTail = b;
+    SDL_CondSignal(writerWake);
+    SDL_UnlockMutex(writerLock);
+}
+
+bool openSegmentStream(const char *path, uint32_t leadIn) {
+    // One at a time; the open one has to be finished first
+    if (streamFile) return false;
+
+    // Don't get too far ahead of the disk
+    SDL_LockMutex(writerLock);
+    while (finishQueued - finishDone >= MAX_FINISHING) {
+        SDL_CondWait(writerDone, writerLock);
+    }
+    SDL_UnlockMutex(writerLock);
+
+    SegmentFile *f = (SegmentFile *)malloc(sizeof(SegmentFile));
+    if (!f) return false;
+
+    f->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (f->fd < 0) {
+        printf("Unable to create %s: %s\n", path, strerror(errno));
+        free(f);
+        return false;
+    }
+
+    // Placeholder header; the real sizes are filled in when it closes.
+    struct wav header;
+    fillWavHeader(&header, writerRate, 0);
+    if (!writeAll(f->fd, &header, sizeof(header))) {
+        printf("Error writing %s: %s\n", path, strerror(errno));
+        close(f->fd);
+        free(f);
+        return false;
+    }
+    f->id = 0;
+    f->frames = 0;
+    f->error = 0;
+    f->finish.data = NULL;
+    f->finish.frames = 0;
+    f->finish.offset = 0;
+
+    streamFile = f;
+    streamFrames = 0;
+    streamBase = 0;
+    heldBase = 0;
+    leadInFrames = leadIn;
+    holding = 1;
+    currentBlock = NULL;
+    return true;
+}
+
+uint32_t writeSegmentSamples(const int16_t *samples, uint32_t frames) {
+    uint32_t done = 0;
+
+    if (!streamFile) return 0;
+    if (holding) releaseHeld();
+
+    while (done < frames) {
+        if (!currentBlock) {
+            currentBlock = getBlock();
+            if (!currentBlock) break;
+        }
+
+        uint32_t n = WRITE_BLOCK_FRAMES - currentBlock->frames;
+        if (n > frames - done) n = frames - done;
+
+        memcpy(&currentBlock->data[currentBlock->frames * writerChannels],
+            &samples[done * writerChannels], n * writerChannels * sizeof(int16_t));
+        currentBlock->frames += n;
+        done += n;
+
+        if (currentBlock->frames == WRITE_BLOCK_FRAMES) {
+            if (holding) {
+                holdBlock(currentBlock);
+            } else {
+                queueBlock(currentBlock);
+            }
+            currentBlock = NULL;
+        }
+    }
+
+    streamFrames += done;
+    return done;
+}
+
+uint32_t segmentStreamFrames() {
+    return streamFrames;
+}
+
+void startSegmentStreamAt(uint32_t frame) {
+    if (!holding) return;
+
+    if (frame < heldBase) frame = heldBase;
+    if (frame > streamFrames) frame = streamFrames;
+
+    uint32_t pos = heldBase;
+    while (heldHead) {
+        WriteBlock *b = heldHead;
+        heldHead = b->next;
+        if (pos + b->frames <= frame) {
+            releaseBlock(b);
+        } else {
+            if (frame > pos) b->offset = frame - pos;
+            queueBlock(b);
+        }
+        pos += b->frames;
+    }
+    heldTail = NULL;
+
+    if (currentBlock && (frame > pos)) {
+        currentBlock->offset = frame - pos;
+    }
+
+    streamBase = frame;
+    holding = 0;
+}
+
+// Send whatever hasn't been queued yet
+static void flushSegmentStream() {
+    if (holding) {
+        startSegmentStreamAt(streamFrames);
+    }
+
+    if (currentBlock) {
+        if (currentBlock->frames > currentBlock->offset) {
+            queueBlock(currentBlock);
+        } else {
+            releaseBlock(currentBlock);
+        }
+        currentBlock = NULL;
+    }
+}
+
+bool finishSegmentStream(uint32_t end, int id) {
+    SegmentFile *f = streamFile;
+    if (!f) return false;
+
+    flushSegmentStream();
+    if (end > streamFrames) end = streamFrames;
+    f->frames = end > streamBase ? end - streamBase : 0;
+    f->id = id;
+
+    SDL_LockMutex(writerLock);
+    finishQueued++;
+    SDL_UnlockMutex(writerLock);
+    queueBlock(&f->finish);
+
+    streamFile = NULL;
+    streamFrames = 0;
+    return true;
+}
+
+void waitForSegmentFiles() {
+    if (!writerThread) return;
+
+    SDL_LockMutex(writerLock);
+    uint32_t target = finishQueued;
+    while ((int32_t)(finishDone - target) < 0) {
+        SDL_CondWait(writerDone, writerLock);
+    }
+    SDL_UnlockMutex(writerLock);
+}
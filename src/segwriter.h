@@ -0,0 +1,60 @@
+#ifndef _SEGWRITER_H
+#define _SEGWRITER_H
+
+#include <stdint.h>
+
+// Segments are streamed to disk while they are being recorded.  Captured
+// audio is copied into fixed size blocks taken from a small pool and
+// queued for a background thread to append to the file, so a take can be
+// any length without the memory footprint growing.
+//
+// Until startSegmentStreamAt() is called the stream only holds on to the
+// most recent leadIn frames before the latest write, so leading silence is
+// trimmed off before it ever reaches the disk.  Frame numbers are counted
+// from the start of the take.
+//
+// Finishing a segment is queued behind its audio too, so the next one can
+// be opened straight away.  The thread fills in the header, fsyncs and
+// closes it, then posts EVENT_SEGMENT or EVENT_SEGMENT_FAILED with the id
+// it was finished with.
+
+#define WRITE_BLOCK_FRAMES 4096
+#define WRITE_POOL_BLOCKS 32
+
+// How many segments can be waiting to be finished before opening
+// another one waits for the oldest
+#define MAX_FINISHING 2
+
+struct SegmentFile;
+
+struct WriteBlock {
+    int16_t *data;      // NULL for the block that finishes the file
+    uint32_t frames;
+    uint32_t offset;    // frames to skip at the start when writing
+    SegmentFile *file;
+    WriteBlock *next;
+};
+
+bool initSegmentWriter(int rate, int channels);
+void shutdownSegmentWriter();
+
+// Fails if another segment is still open.
+bool openSegmentStream(const char *path, uint32_t leadIn);
+
+// Queue samples for writing.  Returns how many frames were accepted,
+// which is less than asked for if the pool has run dry.
+uint32_t writeSegmentSamples(const int16_t *samples, uint32_t frames);
+
+uint32_t segmentStreamFrames();
+
+// Start the file at the given frame and write everything from there on.
+void startSegmentStreamAt(uint32_t frame);
+
+// Have the file cut off before frame end, its header written and the
+// file closed, once everything before it has been written.
+bool finishSegmentStream(uint32_t end, int id);
+
+// Wait until every segment finished so far is safely on disk.
+void waitForSegmentFiles();
+
+#endif
@@ -0,0 +1,583 @@
+/** @file session.cpp
+ *
+ * @brief Recording, trimming and bookkeeping of a session's takes.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <SDL2/SDL.h>
+#include "capture.h"
+#include "wavfile.h"
+#include "segwriter.h"
+#include "combine.h"
+#include "recognizer.h"
+#include "kernels.h"
+#include "session.h"
+#include "stats.h"
+
+int sample_rate = 48000;
+int num_channels = 2;
+char recdir[1024] = {0};
+char filename[1024] = {0};
+
+int recording = 0;
+int recordingRoomNoise = 0;
+int recordingPulse = 0;
+uint32_t samples = 0;
+int16_t *recordingBuffer; //[ROOM_NOISE_SAMPLES * 2];
+int segmentNo = 0;
+int noiseFloor = 0;
+PeakPyramid lastPeaks;
+Manifest sessionManifest;
+int exportFormat = COMBINE_WAV;
+double exportLoudness = 0;
+
+TakeTimes takeTimes;
+
+// Where the key click is in what's been taken off the ring so far
+static int64_t clickStart = -1;
+static uint32_t clickEnd = 0;
+static uint32_t takePosition = 0;
+
+static TrimTracker segmentTrim;
+static int segmentPeak = 0;
+static uint64_t segmentEnergy = 0;
+
+bool dirExists(const char *path) {
+    DIR *dir = opendir(path);
+    if (!dir) {
+        return false;
+    }
+    closedir(dir);
+    return true;
+}
+
+bool fileExists(const char *path) {
+    return (access(path, F_OK) != -1);
+}
+
+bool loadText(const char *f, char *buffer, int len) {
+    int pos = 0;
+    FILE *file = fopen(f, "r");
+    buffer[0] = 0;
+    if (!file) {
+        return false;
+    }
+    int c;
+    while (((c = fgetc(file)) != -1) && (pos < len - 1)) {
+        if (c == '\n') c = ' ';
+        if (c == '\r') c = ' ';
+        buffer[pos++] = c;
+        buffer[pos] = 0;
+    }
+    fclose(file);
+    return true;
+}
+
+bool initSession() {
+    peaksInit(&lastPeaks);
+    recordingBuffer = (int16_t *)malloc(ROOM_NOISE_SAMPLES * 4);
+    return recordingBuffer != NULL;
+}
+
+// ---------------------------------------------------------------- manifest
+
+void saveManifest() {
+    char temp[1024];
+    sprintf(temp, "%s/%s/session.manifest", recdir, filename);
+    sessionManifest.rate = sample_rate;
+    sessionManifest.noiseFloor = noiseFloor;
+    if (!manifestSave(&sessionManifest, temp)) {
+        printf("Unable to save %s\n", temp);
+    }
+}
+
+void readTranscript(int segment) {
+    char temp[1024];
+    char text[4096];
+    SegmentInfo *seg = manifestSegment(&sessionManifest, segment);
+    if (!seg) return;
+
+    sprintf(temp, "%s/%s/segment-%04d.txt", recdir, filename, segment);
+    if (loadText(temp, text, sizeof(text))) {
+        manifestSetTranscript(seg, text);
+        saveManifest();
+    }
+}
+
+// ---------------------------------------------------------------- takes
+
+// Capture is left idle between takes.  Empty the ring before it starts
+// filling again, as the first thing in it will be the pre-roll.
+static void flushRecordingDevice() {
+    ringFlush(&captureRing);
+    clickStart = -1;
+    takePosition = 0;
+    setCaptureIdle(false);
+}
+
+bool beginRoomNoise() {
+    if (combineBusy()) return false;
+
+    noiseFloor = 0;
+    samples = 0;
+
+    char temp[1024];
+    sprintf(temp, "%s/%s", recdir, filename);
+    mkdir(temp, 0777);
+
+    flushRecordingDevice();
+    recording = 1;
+    recordingRoomNoise = 1;
+    return true;
+}
+
+static void resetTake() {
+    trimReset(&segmentTrim, noiseFloor);
+    peaksReset(&lastPeaks);
+    segmentPeak = 0;
+    segmentEnergy = 0;
+    memset(&takeTimes, 0, sizeof(takeTimes));
+}
+
+bool beginTake() {
+    flushRecordingDevice();
+    samples = 0;
+
+    segmentNo++;
+
+    char temp[1024];
+    sprintf(temp, "%s/%s/segment-%04d.wav", recdir, filename, segmentNo);
+    if (!openSegmentStream(temp, TRIM_MARGIN)) {
+        segmentNo--;
+        setCaptureIdle(true);
+        return false;
+    }
+    resetTake();
+
+    // Recognise it as it comes in so the transcript is ready at key-up
+    char txtfile[1024];
+    sprintf(txtfile, "%s/%s/segment-%04d.txt", recdir, filename, segmentNo);
+    beginRecognitionStream(segmentNo, temp, txtfile);
+
+    recording = 1;
+    recordingRoomNoise = 0;
+    return true;
+}
+
+// Pass captured audio on to the segment file, keeping track of where the
+// take crosses the noise floor.  Once it first does, everything from
+// TRIM_MARGIN before that point on is committed to disk.
+static uint32_t recordSegmentSamples(const int16_t *block, uint32_t numSamples) {
+    uint64_t t0 = SDL_GetPerformanceCounter();
+    numSamples = writeSegmentSamples(block, numSamples);
+    uint64_t t1 = SDL_GetPerformanceCounter();
+    peaksAdd(&lastPeaks, block, numSamples);
+
+    int peak = s16AbsMax(block, numSamples * 2);
+    if (peak > segmentPeak) segmentPeak = peak;
+    segmentEnergy += s16SumSquares(block, numSamples * 2);
+    uint64_t t2 = SDL_GetPerformanceCounter();
+    feedRecognitionStream(block, numSamples);
+    uint64_t t3 = SDL_GetPerformanceCounter();
+
+    bool started = segmentTrim.first >= 0;
+    trimUpdate(&segmentTrim, block, numSamples);
+    if (!started && (segmentTrim.first >= 0)) {
+        int64_t start = segmentTrim.first - TRIM_MARGIN;
+        startSegmentStreamAt(start > 0 ? start : 0);
+    }
+    uint64_t t4 = SDL_GetPerformanceCounter();
+
+    takeTimes.write += t1 - t0;
+    takeTimes.peaks += t2 - t1;
+    takeTimes.recognise += t3 - t2;
+    takeTimes.trim += t4 - t3;
+    return numSamples;
+}
+
+// Show the room noise in the waveform display
+static void roomNoisePeaks() {
+    peaksReset(&lastPeaks);
+    peaksAdd(&lastPeaks, recordingBuffer, samples);
+    peaksFinish(&lastPeaks);
+    lastPeaks.first = 0;
+    lastPeaks.last = samples - 1;
+}
+
+static void endRoomNoise() {
+    char temp[1024];
+
+    int peak = s16AbsMax(recordingBuffer, samples * 2);
+    if (peak > noiseFloor) {
+        noiseFloor = peak;
+    }
+
+    noiseFloor *= 10;
+    noiseFloor /= 9;
+
+    sprintf(temp, "%s/%s/room-noise.wav", recdir, filename);
+
+    int recordFd = open(temp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+
+    struct wav header;
+    fillWavHeader(&header, sample_rate, samples);
+    bool ok = recordFd >= 0;
+    if (ok) ok = write(recordFd, &header, sizeof(header)) == sizeof(header);
+    if (ok) ok = write(recordFd, recordingBuffer, samples * 4) == (ssize_t)samples * 4;
+    if (ok) ok = fsync(recordFd) == 0;
+    if (!ok) {
+        printf("Unable to write %s: %s\n", temp, strerror(errno));
+    }
+    if (recordFd >= 0) close(recordFd);
+
+    roomNoisePeaks();
+    saveManifest();
+}
+
+static void endSegment() {
+    char temp[1024];
+    int frames = segmentStreamFrames();
+
+    // Nothing crossed the noise floor; keep just the tail end.
+    if (segmentTrim.first < 0) {
+        segmentTrim.first = frames > 0 ? frames - 1 : 0;
+        segmentTrim.last = segmentTrim.first;
+    }
+
+    int firstSample = segmentTrim.first - TRIM_MARGIN;
+    if (firstSample < 0) firstSample = 0;
+
+    int lastSample = segmentTrim.last + TRIM_MARGIN;
+    if (lastSample > frames - 1) lastSample = frames - 1;
+
+    // The writer finishes the file off in its own time
+    uint64_t t0 = SDL_GetPerformanceCounter();
+    startSegmentStreamAt(firstSample);
+    if (!finishSegmentStream(lastSample + 1, segmentNo)) {
+        printf("Segment %d may be incomplete\n", segmentNo);
+    }
+    takeTimes.close += SDL_GetPerformanceCounter() - t0;
+
+    peaksFinish(&lastPeaks);
+    lastPeaks.first = firstSample;
+    lastPeaks.last = lastSample;
+    sprintf(temp, "%s/%s/segment-%04d.pk", recdir, filename, segmentNo);
+    peaksSave(&lastPeaks, temp);
+
+    // What was trimmed off is below the noise floor, so its energy
+    // is counted against the length that was kept.
+    SegmentInfo *seg = manifestAdd(&sessionManifest);
+    if (seg) {
+        seg->frames = lastSample - firstSample + 1;
+        seg->first = firstSample;
+        seg->last = lastSample;
+        seg->peak = segmentPeak;
+        seg->rms = sqrt((double)segmentEnergy / (seg->frames * 2));
+        seg->status = recordingPulse ? SEGMENT_PULSE : SEGMENT_SPEECH;
+    }
+
+    char wavfile[1024];
+    sprintf(wavfile, "%s/%s/segment-%04d.wav", recdir, filename, segmentNo);
+    sprintf(temp, "%s/%s/segment-%04d.txt", recdir, filename, segmentNo);
+    if (!endRecognitionStream()) {
+        queueRecognition(segmentNo, wavfile, temp);
+    }
+    saveManifest();
+}
+
+void endTake() {
+    uint64_t start = SDL_GetPerformanceCounter();
+    if (recordingRoomNoise) {
+        endRoomNoise();
+    } else {
+        endSegment();
+    }
+
+    samples = 0;
+    recordingRoomNoise = 0;
+    recordingPulse = 0;
+    recording = 0;
+    setCaptureIdle(true);
+    statsTime(TIMER_STOP, start);
+}
+
+// The key went down (or up, for room noise) just after the pre-roll, so
+// the KEY_CLICK frames from there are cut out by position rather than by
+// waiting for them to pass.  Room noise doesn't want the pre-roll either.
+// Returns how many frames to skip, having shortened the block to end
+// where the cut starts if need be.
+static uint32_t keyClickSkip(uint32_t *numSamples) {
+    if (clickStart < 0) {
+        uint32_t lead = capturePrerollFrames();
+        clickStart = recordingRoomNoise ? 0 : lead;
+        clickEnd = lead + KEY_CLICK;
+    }
+    if (takePosition >= clickEnd) return 0;
+
+    if (takePosition < clickStart) {
+        uint32_t before = clickStart - takePosition;
+        if (*numSamples > before) *numSamples = before;
+        return 0;
+    }
+    uint32_t skip = clickEnd - takePosition;
+    if (skip > *numSamples) skip = *numSamples;
+    takePosition += skip;
+    return skip;
+}
+
+bool collectAudio() {
+    const int16_t *block;
+    uint32_t numSamples;
+
+    while ((numSamples = ringReadPtr(&captureRing, &block)) > 0) {
+        if (recording) {
+            uint32_t skip = keyClickSkip(&numSamples);
+            if (skip > 0) {
+                ringCommitRead(&captureRing, skip);
+                continue;
+            }
+        }
+
+        if (recording && recordingRoomNoise) {
+            uint32_t samplesLeft = ROOM_NOISE_SAMPLES - samples;
+            if (numSamples > samplesLeft) {
+                numSamples = samplesLeft;
+            }
+            memcpy(&recordingBuffer[samples * 2], block, numSamples * 4);
+            samples += numSamples;
+        } else if (recording) {
+            // If the writer's pool is empty leave the rest in the ring
+            numSamples = recordSegmentSamples(block, numSamples);
+            if (numSamples == 0) break;
+        }
+        if (recording) takePosition += numSamples;
+        ringCommitRead(&captureRing, numSamples);
+
+        if (recordingRoomNoise && (samples >= ROOM_NOISE_SAMPLES)) {
+            endTake();
+            return true;
+        }
+    }
+    return false;
+}
+
+bool removeLastTake() {
+    char temp[1024];
+
+    if (combineBusy()) return false;
+
+    // Its number is about to be reused, and a late transcript would be
+    // taken for the new take's.  Likewise a late failure from the writer.
+    waitForSegmentFiles();
+    cancelRecognition(segmentNo);
+
+    sprintf(temp, "%s/%s/segment-%04d.wav", recdir, filename, segmentNo);
+    unlink(temp);
+    sprintf(temp, "%s/%s/segment-%04d.txt", recdir, filename, segmentNo);
+    unlink(temp);
+    sprintf(temp, "%s/%s/segment-%04d.pk", recdir, filename, segmentNo);
+    unlink(temp);
+    sprintf(temp, "%s/%s/segment-%04d.ld", recdir, filename, segmentNo);
+    unlink(temp);
+    if (segmentNo > 0) {
+        segmentNo--;
+    }
+    manifestRemoveLast(&sessionManifest);
+    saveManifest();
+    loadLastPeaks();
+    return true;
+}
+
+bool addPulse() {
+    char temp[1024];
+    segmentNo++;
+    sprintf(temp, "%s/%s/segment-%04d.wav", recdir, filename, segmentNo);
+    if (!openSegmentStream(temp, TRIM_MARGIN)) {
+        segmentNo--;
+        return false;
+    }
+    resetTake();
+
+    int16_t cycle[4] = { 32767, 32767, -32768, -32768 };
+    bool whole = true;
+    for (int i = 0; whole && (i < (sample_rate / 10)); i += 2) {
+        whole = recordSegmentSamples(cycle, 2) == 2;
+    }
+
+    // The writer's pool ran dry part way; a short pulse is no use as a
+    // marker, so it's finished off empty and thrown away.
+    if (!whole) {
+        printf("Unable to write the pulse\n");
+        finishSegmentStream(0, 0);
+        unlink(temp);
+        segmentNo--;
+        loadLastPeaks();
+        return false;
+    }
+
+    recording = 1;
+    recordingRoomNoise = 0;
+    recordingPulse = 1;
+    endTake();
+    return true;
+}
+
+bool combineCurrentSession() {
+    char dir[1024];
+    char temp[1024];
+
+    // The last take or two may still be on their way to the disk
+    waitForSegmentFiles();
+
+    sprintf(dir, "%s/%s", recdir, filename);
+    sprintf(temp, "%s/%s.%s", recdir, filename, exportFormat == COMBINE_FLAC ? "flac" : "wav");
+    return startCombine(dir, temp, &sessionManifest, sample_rate, exportFormat, exportLoudness);
+}
+
+// ---------------------------------------------------------------- resuming
+
+static int loadFileToBuffer(const char *fn) {
+    struct WavView view;
+    if (!fileExists(fn)) return 0;
+    if (!wavOpen(&view, fn)) return 0;
+    if (view.channels != 2) {
+        printf("%s: expected stereo\n", fn);
+        wavClose(&view);
+        return 0;
+    }
+    uint32_t frames = view.frames;
+    if (frames > ROOM_NOISE_SAMPLES) frames = ROOM_NOISE_SAMPLES;
+    memcpy(recordingBuffer, view.samples, frames * 4);
+    wavClose(&view);
+    return frames;
+}
+
+// Show the most recent segment in the waveform display
+void loadLastPeaks() {
+    char temp[1024];
+    if (segmentNo > 0) {
+        sprintf(temp, "%s/%s/segment-%04d.pk", recdir, filename, segmentNo);
+        if (peaksLoad(&lastPeaks, temp)) {
+            return;
+        }
+
+        // No summary saved with it; build one from the audio and keep it.
+        char wavfile[1024];
+        struct WavView view;
+        sprintf(wavfile, "%s/%s/segment-%04d.wav", recdir, filename, segmentNo);
+        if (fileExists(wavfile) && wavOpen(&view, wavfile)) {
+            peaksReset(&lastPeaks);
+            if (view.channels == 2) {
+                peaksAdd(&lastPeaks, view.samples, view.frames);
+                peaksFinish(&lastPeaks);
+                lastPeaks.first = 0;
+                lastPeaks.last = view.frames > 0 ? view.frames - 1 : 0;
+                peaksSave(&lastPeaks, temp);
+            }
+            wavClose(&view);
+            return;
+        }
+    }
+    peaksReset(&lastPeaks);
+}
+
+static void loadRoomNoise() {
+    char temp[1024];
+    sprintf(temp, "%s/%s/room-noise.wav", recdir, filename);
+    samples = loadFileToBuffer(temp);
+    noiseFloor = s16AbsMax(recordingBuffer, samples * 2);
+    roomNoisePeaks();
+
+    noiseFloor *= 10;
+    noiseFloor /= 9;
+}
+
+// Add a segment file the manifest doesn't know about, measuring it from
+// the audio itself.
+static bool adoptSegment(int n) {
+    char temp[1024];
+    struct WavView view;
+
+    sprintf(temp, "%s/%s/segment-%04d.wav", recdir, filename, n);
+    if (!fileExists(temp)) return false;
+
+    SegmentInfo *seg = manifestAdd(&sessionManifest);
+    if (!seg) return false;
+
+    if (wavOpen(&view, temp)) {
+        if ((view.channels == 2) && (view.rate == sample_rate)) {
+            seg->frames = view.frames;
+            seg->last = view.frames > 0 ? view.frames - 1 : 0;
+            seg->peak = s16AbsMax(view.samples, view.frames * 2);
+            seg->rms = view.frames ? sqrt((double)s16SumSquares(view.samples, view.frames * 2) / (view.frames * 2)) : 0;
+        } else {
+            printf("%s: doesn't match the session format\n", temp);
+        }
+        wavClose(&view);
+    }
+
+    char text[4096];
+    sprintf(temp, "%s/%s/segment-%04d.txt", recdir, filename, n);
+    if (loadText(temp, text, sizeof(text))) {
+        manifestSetTranscript(seg, text);
+    }
+    return true;
+}
+
+// The rate a file was recorded at, or 0 if it can't be read
+static int fileRate(const char *path) {
+    struct WavView view;
+    if (!wavOpen(&view, path)) return 0;
+    int rate = view.rate;
+    wavClose(&view);
+    return rate;
+}
+
+bool reopenSession() {
+    char temp[1024];
+
+    sprintf(temp, "%s/%s/session.manifest", recdir, filename);
+    bool loaded = manifestLoad(&sessionManifest, temp);
+    if (!loaded && fileExists(temp)) {
+        printf("%s is damaged; rebuilding it\n", temp);
+    }
+
+    // The frame counts and the files themselves only make sense at the
+    // rate they were recorded at.  Without a manifest, the room noise says.
+    int rate = sessionManifest.rate;
+    if (!loaded) {
+        sprintf(temp, "%s/%s/room-noise.wav", recdir, filename);
+        rate = fileRate(temp);
+    }
+    if ((rate > 0) && (rate != sample_rate)) {
+        printf("Session %s was recorded at %dHz; use -R %d to carry on with it\n", filename, rate, rate);
+        manifestFree(&sessionManifest);
+        return false;
+    }
+
+    loadRoomNoise();
+
+    // Sessions from before there was a manifest, or a take that never
+    // finished, leave segments on disk that it doesn't list.
+    int adopted = 0;
+    while (adoptSegment(sessionManifest.count + 1)) {
+        adopted++;
+    }
+    if (adopted > 0) {
+        saveManifest();
+    }
+
+    segmentNo = sessionManifest.count;
+    if (segmentNo > 0) {
+        loadLastPeaks();
+    }
+    return true;
+}
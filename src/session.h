@@ -0,0 +1,94 @@
+#ifndef _SESSION_H
+#define _SESSION_H
+
+#include <stdint.h>
+#include "trim.h"
+#include "peaks.h"
+#include "manifest.h"
+
+// The recording side of a session: room noise, takes going from the
+// capture ring through trimming, the segment writer and the recogniser,
+// and the manifest that keeps track of them.  Nothing in here draws
+// anything, so the recorder's UI and the benchmark drive the same code.
+
+// Room noise is held in memory; segments are streamed to disk
+#define ROOM_NOISE_SAMPLES (sample_rate * 5)
+
+// Room noise left either side of a trimmed segment
+#define TRIM_MARGIN (sample_rate / 10)
+
+// Cut out where the key that started recording was pressed
+#define KEY_CLICK (sample_rate / 10)
+
+extern int sample_rate;
+extern int num_channels;
+extern char recdir[1024];
+extern char filename[1024];
+
+extern int recording;
+extern int recordingRoomNoise;
+extern int recordingPulse;
+extern uint32_t samples;
+extern int16_t *recordingBuffer;
+extern int segmentNo;
+extern int noiseFloor;
+extern PeakPyramid lastPeaks;
+extern Manifest sessionManifest;
+extern int exportFormat;
+extern double exportLoudness;
+
+// Time spent on each stage of the take in progress, in performance
+// counter ticks.  Cleared when a take starts.
+struct TakeTimes {
+    uint64_t trim;
+    uint64_t write;     // queueing for the writer, not the disk itself
+    uint64_t peaks;
+    uint64_t recognise; // resampling and handing over to the recogniser
+    uint64_t close;     // handing the file over to be finished at the end
+};
+
+extern TakeTimes takeTimes;
+
+bool dirExists(const char *path);
+bool fileExists(const char *path);
+bool loadText(const char *f, char *buffer, int len);
+
+bool initSession();
+
+void saveManifest();
+
+// Pick up a segment's transcript once the recogniser has written it.
+void readTranscript(int segment);
+
+// Returns false while a combine is running, as it may still be reading
+// the room noise.
+bool beginRoomNoise();
+
+// Returns false, with nothing started, if the segment can't be created.
+bool beginTake();
+
+// Finish off whichever of the two is being recorded.
+void endTake();
+
+// Empty the capture ring into whatever is being recorded.  Returns true
+// if the room noise filled up and was ended by it.
+bool collectAudio();
+
+// Returns false while a combine is running, since the take could be one
+// it's still reading.  A new take gets a number past any the combine
+// knows about, so recording can go ahead meanwhile.
+bool removeLastTake();
+
+// Add a short full scale square wave as a segment of its own.  Returns
+// false, with nothing added, if it couldn't all be written.
+bool addPulse();
+
+bool combineCurrentSession();
+
+void loadLastPeaks();
+
+// Returns false, with nothing loaded, if the session was recorded at
+// another rate.
+bool reopenSession();
+
+#endif
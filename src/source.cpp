@@ -0,0 +1,117 @@
+/** @file source.cpp
+ *
+ * @brief Audio sources that stand in for the capture device.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include "source.h"
+
+#define NOISE_LEVEL     64      // about -54dBFS
+#define SPEECH_LEVEL    4000
+#define SPEECH_HARMONICS 5
+
+#define SENTENCE_SECONDS 4.0
+#define PAUSE_SECONDS    0.5
+#define SYLLABLE_SECONDS 0.25
+#define VOICED_SECONDS   0.18
+
+bool sourceOpenWav(AudioSource *src, const char *path, int rate, int channels) {
+    memset(src, 0, sizeof(AudioSource));
+    if (!wavOpen(&src->view, path)) return false;
+
+    if ((src->view.rate != rate) || (src->view.channels != channels) || (src->view.frames == 0)) {
+        printf("%s: expected %d channels at %dHz\n", path, channels, rate);
+        wavClose(&src->view);
+        return false;
+    }
+    src->type = SOURCE_WAV;
+    src->rate = rate;
+    src->channels = channels;
+    return true;
+}
+
+void sourceOpenSynth(AudioSource *src, int type, int rate, int channels) {
+    memset(src, 0, sizeof(AudioSource));
+    src->type = type;
+    src->rate = rate;
+    src->channels = channels;
+    sourceRewind(src);
+}
+
+void sourceClose(AudioSource *src) {
+    if (src->type == SOURCE_WAV) {
+        wavClose(&src->view);
+    }
+}
+
+void sourceRewind(AudioSource *src) {
+    src->position = 0;
+    src->seed = 2463534242u;
+    src->phase = 0;
+}
+
+static inline int noise(AudioSource *src) {
+    uint32_t x = src->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    src->seed = x;
+    return (int)(x >> 25) - NOISE_LEVEL;
+}
+
+// How loud the voice is at time t: nothing for the pause at the start of
+// each sentence, then a run of syllables with a gap after each.
+static double envelope(double t) {
+    double s = fmod(t, SENTENCE_SECONDS) - PAUSE_SECONDS;
+    if (s < 0) return 0;
+    double syllable = fmod(s, SYLLABLE_SECONDS);
+    if (syllable >= VOICED_SECONDS) return 0;
+    return sin(M_PI * syllable / VOICED_SECONDS);
+}
+
+static void synthesise(AudioSource *src, int16_t *out, uint32_t frames) {
+    for (uint32_t i = 0; i < frames; i++) {
+        double v = noise(src);
+
+        if (src->type == SOURCE_SPEECH) {
+            double t = (double)src->position / src->rate;
+            double env = envelope(t);
+
+            // The pitch wanders a little so it isn't one steady tone
+            double f0 = 140 + 40 * sin(2 * M_PI * 0.3 * t);
+            src->phase = fmod(src->phase + 2 * M_PI * f0 / src->rate, 2 * M_PI);
+
+            if (env > 0) {
+                double voice = 0;
+                for (int h = 1; h <= SPEECH_HARMONICS; h++) {
+                    voice += sin(h * src->phase) / h;
+                }
+                v += env * SPEECH_LEVEL * voice;
+            }
+        }
+
+        for (int c = 0; c < src->channels; c++) {
+            *out++ = (int16_t)lrint(v);
+        }
+        src->position++;
+    }
+}
+
+void sourceRead(AudioSource *src, int16_t *out, uint32_t frames) {
+    if (src->type != SOURCE_WAV) {
+        synthesise(src, out, frames);
+        return;
+    }
+
+    while (frames > 0) {
+        uint32_t at = src->position % src->view.frames;
+        uint32_t n = src->view.frames - at;
+        if (n > frames) n = frames;
+        memcpy(out, &src->view.samples[at * src->channels], n * src->channels * sizeof(int16_t));
+        out += n * src->channels;
+        frames -= n;
+        src->position += n;
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef _SOURCE_H
+#define _SOURCE_H
+
+#include <stdint.h>
+#include "wavfile.h"
+
+// Stand-ins for the capture device, for running sessions with no
+// hardware.  A source either plays a WAV file round and round or makes
+// something up: quiet noise for the room, or the same noise with bursts
+// of voice-like harmonics in it, in four second sentences that each
+// start with half a second of quiet so there's something to trim.
+// Either way it's deterministic, so runs can be compared.
+
+#define SOURCE_WAV      0
+#define SOURCE_NOISE    1
+#define SOURCE_SPEECH   2
+
+struct AudioSource {
+    int type;
+    int rate;
+    int channels;
+    uint32_t position;      // frames produced since the last rewind
+    struct WavView view;
+    uint32_t seed;
+    double phase;
+};
+
+// The file has to be 16-bit at the given rate and channel count.
+bool sourceOpenWav(AudioSource *src, const char *path, int rate, int channels);
+void sourceOpenSynth(AudioSource *src, int type, int rate, int channels);
+void sourceClose(AudioSource *src);
+
+void sourceRewind(AudioSource *src);
+
+// Interleaved S16; there's always as much as is asked for.
+void sourceRead(AudioSource *src, int16_t *out, uint32_t frames);
+
+#endif
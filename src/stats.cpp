@@ -0,0 +1,177 @@
+/** @file stats.cpp
+ *
+ * @brief Capture path counters, histograms and stage timings.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <SDL2/SDL.h>
+#include "capture.h"
+#include "stats.h"
+
+CaptureStats captureStats;
+
+StageTimer stageTimers[TIMER_COUNT] = {
+    { "stop" },
+    { "speech" },
+    { "stream" },
+    { "combine" },
+};
+
+void statsHistogram(uint32_t *bins, uint64_t value) {
+    int bin = 0;
+    while ((value > 1) && (bin < STATS_BINS - 1)) {
+        value >>= 1;
+        bin++;
+    }
+    __atomic_fetch_add(&bins[bin], 1, __ATOMIC_RELAXED);
+}
+
+void statsPeak(uint32_t *peak, uint32_t value) {
+    uint32_t old = __atomic_load_n(peak, __ATOMIC_RELAXED);
+    while ((value > old) &&
+           !__atomic_compare_exchange_n(peak, &old, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+void statsTime(int timer, uint64_t start) {
+    StageTimer *t = &stageTimers[timer];
+    uint64_t us = (SDL_GetPerformanceCounter() - start) * 1000000 / SDL_GetPerformanceFrequency();
+
+    __atomic_fetch_add(&t->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&t->totalUs, us, __ATOMIC_RELAXED);
+    uint64_t old = __atomic_load_n(&t->maxUs, __ATOMIC_RELAXED);
+    while ((us > old) &&
+           !__atomic_compare_exchange_n(&t->maxUs, &old, us, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+static uint32_t load(const uint32_t *v) {
+    return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+static void formatMicros(char *buffer, size_t len, uint64_t us) {
+    if (us >= 10000000) {
+        snprintf(buffer, len, "%.0fs", us / 1e6);
+    } else if (us >= 1000000) {
+        snprintf(buffer, len, "%.1fs", us / 1e6);
+    } else if (us >= 1000) {
+        snprintf(buffer, len, "%.0fms", us / 1e3);
+    } else {
+        snprintf(buffer, len, "%uus", (unsigned)us);
+    }
+}
+
+// The commonest bin and how much of the total it has, and the highest one
+// used, by their lower bounds.
+static bool summarise(const uint32_t *bins, uint64_t *common, int *percent, uint64_t *highest) {
+    uint64_t total = 0;
+    uint32_t best = 0;
+    int bestBin = 0, top = -1;
+
+    for (int i = 0; i < STATS_BINS; i++) {
+        uint32_t n = load(&bins[i]);
+        total += n;
+        if (n > best) {
+            best = n;
+            bestBin = i;
+        }
+        if (n) top = i;
+    }
+    if (top < 0) return false;
+
+    *common = bestBin ? 1ULL << bestBin : 0;
+    *percent = best * 100 / total;
+    *highest = top ? 1ULL << top : 0;
+    return true;
+}
+
+static void timerText(char *buffer, size_t len, int timer) {
+    StageTimer *t = &stageTimers[timer];
+    uint32_t count = load(&t->count);
+    if (count == 0) {
+        snprintf(buffer, len, "%s -", t->name);
+        return;
+    }
+
+    char mean[16], max[16];
+    formatMicros(mean, sizeof(mean), __atomic_load_n(&t->totalUs, __ATOMIC_RELAXED) / count);
+    formatMicros(max, sizeof(max), __atomic_load_n(&t->maxUs, __ATOMIC_RELAXED));
+    snprintf(buffer, len, "%s %s/%s", t->name, mean, max);
+}
+
+int statsOverlay(char lines[][STATS_LINE_LEN], int max) {
+    int n = 0;
+    uint64_t common, highest;
+    int percent;
+
+    if (n < max) {
+        snprintf(lines[n++], STATS_LINE_LEN, "xrun %u short %u drop %u err %u",
+                 load(&captureStats.xruns), load(&captureStats.shortReads),
+                 (uint32_t)captureDropped, load(&captureStats.errors) + load(&captureStats.suspends));
+    }
+    if (n < max) {
+        snprintf(lines[n++], STATS_LINE_LEN, "ring peak %u of %u",
+                 load(&captureStats.ringPeak), captureRing.size);
+    }
+    if ((n < max) && summarise(captureStats.readFrames, &common, &percent, &highest)) {
+        snprintf(lines[n++], STATS_LINE_LEN, "read %llu+ %d%%, max %llu+",
+                 (unsigned long long)common, percent, (unsigned long long)highest);
+    }
+    if ((n < max) && summarise(captureStats.wakeGaps, &common, &percent, &highest)) {
+        char a[16], b[16];
+        formatMicros(a, sizeof(a), common);
+        formatMicros(b, sizeof(b), highest);
+        snprintf(lines[n++], STATS_LINE_LEN, "wake %s+ %d%%, max %s+", a, percent, b);
+    }
+    for (int i = 0; (i < TIMER_COUNT) && (n < max); i += 2) {
+        char a[24], b[24];
+        timerText(a, sizeof(a), i);
+        timerText(b, sizeof(b), i + 1);
+        snprintf(lines[n++], STATS_LINE_LEN, "%s  %s", a, b);
+    }
+    return n;
+}
+
+static void writeHistogram(FILE *f, const char *name, const uint32_t *bins) {
+    fprintf(f, "%s", name);
+    for (int i = 0; i < STATS_BINS; i++) {
+        uint32_t n = load(&bins[i]);
+        if (n) fprintf(f, " %llu:%u", i ? 1ULL << i : 0ULL, n);
+    }
+    fprintf(f, "\n");
+}
+
+// One "name value" line per counter.  Histograms list lower bound:count
+// for the bins in use, and timers give count, total and max.
+bool statsWrite(const char *path) {
+    char temp[1040];
+    snprintf(temp, sizeof(temp), "%s.tmp", path);
+    FILE *f = fopen(temp, "w");
+    if (!f) return false;
+
+    fprintf(f, "xruns %u\n", load(&captureStats.xruns));
+    fprintf(f, "suspends %u\n", load(&captureStats.suspends));
+    fprintf(f, "errors %u\n", load(&captureStats.errors));
+    fprintf(f, "short_reads %u\n", load(&captureStats.shortReads));
+    fprintf(f, "dropped_frames %u\n", (uint32_t)captureDropped);
+    fprintf(f, "ring_peak %u\n", load(&captureStats.ringPeak));
+    fprintf(f, "ring_size %u\n", captureRing.size);
+    writeHistogram(f, "read_frames", captureStats.readFrames);
+    writeHistogram(f, "wake_gap_us", captureStats.wakeGaps);
+    for (int i = 0; i < TIMER_COUNT; i++) {
+        StageTimer *t = &stageTimers[i];
+        fprintf(f, "%s_us %u %llu %llu\n", t->name, load(&t->count),
+                (unsigned long long)__atomic_load_n(&t->totalUs, __ATOMIC_RELAXED),
+                (unsigned long long)__atomic_load_n(&t->maxUs, __ATOMIC_RELAXED));
+    }
+
+    bool ok = !ferror(f);
+    if (fclose(f) != 0) ok = false;
+    if (!ok || (rename(temp, path) < 0)) {
+        unlink(temp);
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,62 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Counters for the capture path, so that dropped audio shows up as a
+// number rather than as a gap on listening back, and timings of the
+// slower stages.  They're bumped with atomics from whichever thread sees
+// the event and read without stopping anything, so a snapshot can be a
+// count or two out between fields.
+//
+// Histograms count values by power of two: bin 0 holds 0 and 1, bin n
+// above that holds 2^n up to 2^(n+1) - 1, and anything too big goes in
+// the last.
+
+#define STATS_BINS 24
+
+struct CaptureStats {
+    uint32_t xruns;             // the device overran
+    uint32_t suspends;
+    uint32_t errors;            // anything else that needed recovering from
+    uint32_t shortReads;        // a read came back with less than was there
+    uint32_t ringPeak;          // most frames ever waiting in the ring
+    uint32_t readFrames[STATS_BINS];    // frames taken at each wakeup
+    uint32_t wakeGaps[STATS_BINS];      // microseconds between wakeups
+};
+
+struct StageTimer {
+    const char *name;
+    uint32_t count;
+    uint64_t totalUs;
+    uint64_t maxUs;
+};
+
+#define TIMER_STOP      0   // ending a take, until its file is handed over
+#define TIMER_SPEECH    1   // recognising a segment from its file
+#define TIMER_STREAM    2   // finishing off a streamed segment after key-up
+#define TIMER_COMBINE   3
+#define TIMER_COUNT     4
+
+extern CaptureStats captureStats;
+extern StageTimer stageTimers[TIMER_COUNT];
+
+static inline void statsCount(uint32_t *counter) {
+    __atomic_fetch_add(counter, 1, __ATOMIC_RELAXED);
+}
+
+void statsHistogram(uint32_t *bins, uint64_t value);
+void statsPeak(uint32_t *peak, uint32_t value);
+
+// Add the time since start, a performance counter reading
+void statsTime(int timer, uint64_t start);
+
+// A few short lines for the debug overlay; returns how many
+#define STATS_LINE_LEN 48
+int statsOverlay(char lines[][STATS_LINE_LEN], int max);
+
+// Everything, rewritten under another name and renamed into place
+bool statsWrite(const char *path);
+
+#endif
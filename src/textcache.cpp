@@ -0,0 +1,177 @@
+/** @file textcache.cpp
+ *
+ * @brief Caches of rendered text surfaces and glyphs.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+#include "textcache.h"
+
+#define TEXT_CACHE_SIZE 32
+#define GLYPH_FIRST 32
+#define GLYPH_LAST 126
+#define GLYPH_COUNT (GLYPH_LAST - GLYPH_FIRST + 1)
+#define MAX_ATLASES 8
+
+struct CachedText {
+    char *message;
+    uint32_t colour;
+    SDL_Surface *surface;
+    uint32_t used;
+};
+
+struct GlyphAtlas {
+    uint32_t colour;
+    SDL_Surface *surface;
+    SDL_Rect src[GLYPH_COUNT];
+    int advance[GLYPH_COUNT];
+};
+
+static TTF_Font *cacheFont = NULL;
+static CachedText textCache[TEXT_CACHE_SIZE];
+static uint32_t textCacheClock = 0;
+static GlyphAtlas *atlases[MAX_ATLASES];
+static int numAtlases = 0;
+
+static inline uint32_t colourKey(SDL_Color &col) {
+    return (col.r << 24) | (col.g << 16) | (col.b << 8) | col.a;
+}
+
+void initTextCache(TTF_Font *font) {
+    cacheFont = font;
+    memset(textCache, 0, sizeof(textCache));
+    numAtlases = 0;
+}
+
+void freeTextCache() {
+    for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+        free(textCache[i].message);
+        if (textCache[i].surface) SDL_FreeSurface(textCache[i].surface);
+    }
+    memset(textCache, 0, sizeof(textCache));
+
+    for (int i = 0; i < numAtlases; i++) {
+        SDL_FreeSurface(atlases[i]->surface);
+        free(atlases[i]);
+    }
+    numAtlases = 0;
+}
+
+static void blit(SDL_Surface *src, SDL_Rect *from, SDL_Surface *dst, int x, int y) {
+    SDL_Rect r;
+    r.x = x;
+    r.y = y;
+    r.w = from ? from->w : src->w;
+    r.h = from ? from->h : src->h;
+    SDL_BlitSurface(src, from, dst, &r);
+}
+
+void drawCachedText(SDL_Surface *dst, const char *message, int x, int y, SDL_Color &col) {
+    uint32_t key = colourKey(col);
+    CachedText *slot = &textCache[0];
+
+    textCacheClock++;
+
+    for (int i = 0; i < TEXT_CACHE_SIZE; i++) {
+        CachedText *c = &textCache[i];
+        if (c->message && (c->colour == key) && !strcmp(c->message, message)) {
+            c->used = textCacheClock;
+            blit(c->surface, NULL, dst, x, y);
+            return;
+        }
+        // Remember the least recently used slot in case we miss
+        if (c->used < slot->used) slot = c;
+    }
+
+    SDL_Surface *fn = TTF_RenderText_Blended(cacheFont, message, col);
+    if (!fn) return;
+
+    free(slot->message);
+    if (slot->surface) SDL_FreeSurface(slot->surface);
+    slot->message = strdup(message);
+    slot->colour = key;
+    slot->surface = fn;
+    slot->used = textCacheClock;
+
+    blit(fn, NULL, dst, x, y);
+}
+
+static GlyphAtlas *buildAtlas(SDL_Color &col) {
+    GlyphAtlas *a = (GlyphAtlas *)malloc(sizeof(GlyphAtlas));
+    if (!a) return NULL;
+
+    SDL_Surface *glyphs[GLYPH_COUNT];
+    int width = 0;
+    int height = TTF_FontHeight(cacheFont);
+
+    // Each glyph is rendered as a one character string so it comes out
+    // a full line high with the same baseline as TTF_RenderText.
+    for (int i = 0; i < GLYPH_COUNT; i++) {
+        char str[2] = { (char)(GLYPH_FIRST + i), 0 };
+        int minx, maxx, miny, maxy, advance;
+        glyphs[i] = TTF_RenderText_Blended(cacheFont, str, col);
+        TTF_GlyphMetrics(cacheFont, GLYPH_FIRST + i, &minx, &maxx, &miny, &maxy, &advance);
+        a->advance[i] = advance;
+        a->src[i].x = width;
+        a->src[i].y = 0;
+        a->src[i].w = glyphs[i] ? glyphs[i]->w : 0;
+        a->src[i].h = glyphs[i] ? glyphs[i]->h : 0;
+        if (a->src[i].h > height) height = a->src[i].h;
+        width += a->src[i].w;
+    }
+
+    a->surface = SDL_CreateRGBSurfaceWithFormat(0, width, height, 32, SDL_PIXELFORMAT_ARGB8888);
+    if (!a->surface) {
+        for (int i = 0; i < GLYPH_COUNT; i++) {
+            if (glyphs[i]) SDL_FreeSurface(glyphs[i]);
+        }
+        free(a);
+        return NULL;
+    }
+    SDL_FillRect(a->surface, NULL, 0);
+
+    for (int i = 0; i < GLYPH_COUNT; i++) {
+        if (!glyphs[i]) continue;
+        // Copy the glyph's alpha straight in rather than blending it
+        SDL_SetSurfaceBlendMode(glyphs[i], SDL_BLENDMODE_NONE);
+        SDL_Rect r = a->src[i];
+        SDL_BlitSurface(glyphs[i], NULL, a->surface, &r);
+        SDL_FreeSurface(glyphs[i]);
+    }
+    SDL_SetSurfaceBlendMode(a->surface, SDL_BLENDMODE_BLEND);
+
+    a->colour = colourKey(col);
+    return a;
+}
+
+static GlyphAtlas *getAtlas(SDL_Color &col) {
+    uint32_t key = colourKey(col);
+    for (int i = 0; i < numAtlases; i++) {
+        if (atlases[i]->colour == key) return atlases[i];
+    }
+    if (numAtlases == MAX_ATLASES) return NULL;
+
+    GlyphAtlas *a = buildAtlas(col);
+    if (a) atlases[numAtlases++] = a;
+    return a;
+}
+
+void drawGlyphText(SDL_Surface *dst, const char *message, int x, int y, SDL_Color &col) {
+    GlyphAtlas *a = getAtlas(col);
+    if (!a) {
+        drawCachedText(dst, message, x, y, col);
+        return;
+    }
+
+    for (const char *p = message; *p; p++) {
+        int c = (unsigned char)*p;
+        if ((c < GLYPH_FIRST) || (c > GLYPH_LAST)) c = '?';
+        int i = c - GLYPH_FIRST;
+
+        blit(a->surface, &a->src[i], dst, x, y);
+        x += a->advance[i];
+    }
+}
@@ -0,0 +1,21 @@
+#ifndef _TEXTCACHE_H
+#define _TEXTCACHE_H
+
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_ttf.h>
+
+// Rendering text with TTF_RenderText_Blended is by far the most expensive
+// part of a redraw.  Fixed strings are rendered once and kept by
+// (string, colour); strings that change all the time are drawn a glyph
+// at a time from a pre-rendered atlas instead.
+
+void initTextCache(TTF_Font *font);
+void freeTextCache();
+
+// Draw a string that is likely to be drawn again exactly as it is.
+void drawCachedText(SDL_Surface *dst, const char *message, int x, int y, SDL_Color &col);
+
+// Draw a string that changes often, from the glyph atlas.
+void drawGlyphText(SDL_Surface *dst, const char *message, int x, int y, SDL_Color &col);
+
+#endif
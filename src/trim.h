@@ -0,0 +1,50 @@
+#ifndef _TRIM_H
+#define _TRIM_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "kernels.h"
+
+// Tracks the first and last frames of a take that rise above the noise
+// floor, one block at a time as the audio arrives, so nothing needs to
+// be rescanned when the take ends.
+
+struct TrimTracker {
+    int threshold;
+    uint32_t frames;    // frames seen so far
+    int64_t first;      // -1 until something crosses the threshold
+    int64_t last;
+};
+
+static inline void trimReset(TrimTracker *t, int threshold) {
+    t->threshold = threshold;
+    t->frames = 0;
+    t->first = -1;
+    t->last = -1;
+}
+
+// Feed a block of interleaved stereo frames.
+static inline void trimUpdate(TrimTracker *t, const int16_t *samples, uint32_t n) {
+    ptrdiff_t start = 0;
+
+    if (n == 0) return;
+
+    if (t->first < 0) {
+        start = s16FirstAbove(samples, n * 2, t->threshold);
+        if (start < 0) {
+            t->frames += n;
+            return;
+        }
+        start /= 2;
+        t->first = t->frames + start;
+    }
+
+    ptrdiff_t end = s16LastAbove(&samples[start * 2], (n - start) * 2, t->threshold);
+    if (end >= 0) {
+        t->last = t->frames + start + end / 2;
+    }
+
+    t->frames += n;
+}
+
+#endif
@@ -0,0 +1,132 @@
+/** @file wavfile.cpp
+ *
+ * @brief Memory-mapped WAV file reader.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "wavfile.h"
+
+#define WAVE_FORMAT_PCM         0x0001
+#define WAVE_FORMAT_EXTENSIBLE  0xFFFE
+
+static inline uint32_t le32(const uint8_t *p) {
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint16_t le16(const uint8_t *p) {
+	return p[0] | (p[1] << 8);
+}
+
+static bool fail(struct WavView *view, const char *path, const char *why) {
+	printf("%s: %s\n", path, why);
+	wavClose(view);
+	return false;
+}
+
+bool wavOpen(struct WavView *view, const char *path) {
+	memset(view, 0, sizeof(struct WavView));
+	view->map = MAP_FAILED;
+
+	view->fd = open(path, O_RDONLY);
+	if (view->fd < 0) {
+		return fail(view, path, strerror(errno));
+	}
+
+	struct stat sb;
+	if (fstat(view->fd, &sb) < 0) {
+		return fail(view, path, strerror(errno));
+	}
+	if (sb.st_size < 12) {
+		return fail(view, path, "too short for a WAV file");
+	}
+
+	view->mapLen = sb.st_size;
+	view->map = mmap(NULL, view->mapLen, PROT_READ, MAP_PRIVATE, view->fd, 0);
+	if (view->map == MAP_FAILED) {
+		return fail(view, path, strerror(errno));
+	}
+	madvise(view->map, view->mapLen, MADV_SEQUENTIAL);
+
+	const uint8_t *base = (const uint8_t *)view->map;
+	const uint8_t *end = base + view->mapLen;
+
+	if (memcmp(base, "RIFF", 4) || memcmp(base + 8, "WAVE", 4)) {
+		return fail(view, path, "not a RIFF WAVE file");
+	}
+
+	int format = 0;
+	bool haveFmt = false;
+	bool haveData = false;
+	const uint8_t *p = base + 12;
+
+	while (!haveData && (end - p >= 8)) {
+		uint32_t size = le32(p + 4);
+		const uint8_t *body = p + 8;
+		uint64_t avail = end - body;
+
+		if (!memcmp(p, "fmt ", 4)) {
+			if ((size < 16) || (avail < 16)) {
+				return fail(view, path, "truncated fmt chunk");
+			}
+			format = le16(body);
+			view->channels = le16(body + 2);
+			view->rate = le32(body + 4);
+			view->bits = le16(body + 14);
+			if ((format == WAVE_FORMAT_EXTENSIBLE) && (size >= 26) && (avail >= 26)) {
+				format = le16(body + 24);
+			}
+			haveFmt = true;
+		} else if (!memcmp(p, "data", 4)) {
+			// A segment that was never closed properly still has the
+			// placeholder size; take everything to the end of the file.
+			if ((size == 0) || (size > avail)) {
+				size = avail;
+			}
+			view->dataOffset = body - base;
+			view->dataBytes = size;
+			haveData = true;
+			break;
+		}
+
+		// Don't step outside the mapping on a corrupt size.  A pad byte
+		// missing from the very end of the file is let go.
+		if (size > avail) {
+			return fail(view, path, "chunk runs past the end of the file");
+		}
+		uint64_t skip = (uint64_t)size + (size & 1);
+		p = skip < avail ? body + skip : end;
+	}
+
+	if (!haveFmt) {
+		return fail(view, path, "no fmt chunk");
+	}
+	if (!haveData) {
+		return fail(view, path, "no data chunk");
+	}
+	if ((format != WAVE_FORMAT_PCM) || (view->bits != 16) || (view->channels < 1)) {
+		return fail(view, path, "not 16-bit PCM");
+	}
+
+	view->samples = (const int16_t *)(base + view->dataOffset);
+	view->frames = view->dataBytes / (view->channels * 2);
+	return true;
+}
+
+void wavClose(struct WavView *view) {
+	if ((view->map != MAP_FAILED) && (view->map != NULL)) {
+		munmap(view->map, view->mapLen);
+	}
+	if (view->fd >= 0) {
+		close(view->fd);
+	}
+	view->map = NULL;
+	view->fd = -1;
+	view->samples = NULL;
+	view->frames = 0;
+}
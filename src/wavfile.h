@@ -0,0 +1,71 @@
+#ifndef _WAVFILE_H
+#define _WAVFILE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct wav {
+	// RIFF header
+	uint32_t riff_chunkid;
+	uint32_t riff_chunksize;
+	uint32_t riff_format;
+
+	// Format header
+	uint32_t fmt_chunkid;
+	uint32_t fmt_chunksize;
+	uint16_t fmt_audioformat;
+	uint16_t fmt_numchannels;
+	uint32_t fmt_samplerate;
+	uint32_t fmt_byterate;
+	uint16_t fmt_blockalign;
+	uint16_t fmt_bitspersample;
+
+	// Data chunk
+	uint32_t data_chunkid;
+	uint32_t data_chunksize;
+};
+
+// Fill in a 16-bit stereo PCM header for the given number of frames.
+static inline void fillWavHeader(struct wav *header, int rate, uint32_t frames) {
+	header->riff_chunkid = 0x46464952;
+	header->riff_chunksize = frames * 2 * 2 + 36;
+	header->riff_format = 0x45564157;
+
+	header->fmt_chunkid = 0x20746d66;
+	header->fmt_chunksize = 16;
+	header->fmt_audioformat = 1;
+	header->fmt_numchannels =  2;
+	header->fmt_samplerate = rate;
+	header->fmt_byterate = rate * 2 * 2;
+	header->fmt_blockalign = 2 * 2;
+	header->fmt_bitspersample = 16;
+
+	header->data_chunkid = 0x61746164;
+	header->data_chunksize = frames * 2 * 2;
+}
+
+// A read-only view of a WAV file.  The file is mapped and its RIFF chunks
+// walked to find the format and the sample data, so samples points
+// straight into the mapping.  fd is left open for kernel-side copies of
+// the data chunk.
+struct WavView {
+	int fd;
+	void *map;
+	size_t mapLen;
+
+	int rate;
+	int channels;
+	int bits;
+
+	off_t dataOffset;
+	uint64_t dataBytes;
+	const int16_t *samples;
+	uint32_t frames;
+};
+
+// Only 16-bit PCM is accepted.  Prints why on failure.
+bool wavOpen(struct WavView *view, const char *path);
+void wavClose(struct WavView *view);
+
+#endif